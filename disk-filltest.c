@@ -29,20 +29,37 @@
  * Version 0.8.0W 20171129 https://github.com/Maaciej/disk-filltest
  *****************************************************************************/
 
+#define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 
+#ifdef _WIN32
 #include <Windows.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#endif
+
 #include <math.h>
 
 /* random seed used */
@@ -60,6 +77,51 @@ int gopt_unlink_after = 0;
 /* individual file size in MiB */
 unsigned int gopt_file_size = 1024;
 
+/* cleanup: parallel unlink threads and discard before unlinking */
+unsigned int gopt_cleanup_threads = 4;
+int gopt_discard = 0;
+
+/* flush profiling: flush every n MiB written (0 = off) and at each file end */
+unsigned int gopt_flush_every = 0;
+int gopt_flush_file_end = 0;
+
+/* run history file (NULL = off) and comparison against it */
+char* gopt_history = NULL;
+int gopt_compare = 0;
+
+/* binary I/O trace file, trace to replay and replay with recorded timing */
+char* gopt_trace = NULL;
+char* gopt_replay = NULL;
+int gopt_replay_timing = 0;
+
+/* metadata stress: number of files (0 = off), file size in bytes, number
+ * of subdirectories and threads */
+unsigned int gopt_md_files = 0;
+unsigned int gopt_md_size = 4096;
+unsigned int gopt_md_shards = 256;
+unsigned int gopt_md_threads = 1;
+
+/* sample block device statistics during writing and reading */
+int gopt_device_stats = 0;
+
+/* burn-in: number of passes (0 = until --duration), duration in minutes,
+ * degradation threshold in percent, verify-only passes after the first */
+unsigned int gopt_passes = 1;
+unsigned int gopt_duration = 0;
+double gopt_drift = 10;
+int gopt_retention = 0;
+
+/* classify bad blocks and search where their data came from */
+int gopt_forensic = 0;
+
+/* transfer block size in bytes, tuned at startup with --block-size auto */
+unsigned int gopt_block_size = 1024 * 1024;
+int gopt_block_size_set = 0;
+int gopt_block_size_tune = 0;
+
+/* size of each probe file written by the block size tuner in MiB */
+unsigned int gopt_tune_size = 1024;
+
 /* file number limit */
 unsigned int gopt_file_limit = UINT_MAX;
 
@@ -67,6 +129,11 @@ unsigned int gopt_file_limit = UINT_MAX;
 unsigned int gopt_sector_size_in512 = 8;
 unsigned int fulfill = 0;
 
+/* verify-while-writing: trailing verifier lag in files (0 = off) */
+unsigned int gopt_verify_lag = 0;
+int gopt_verify_final = 0;
+int gopt_stop_on_error = 0;
+
 /* output conf */
 unsigned int multicolor = 0;
 unsigned int errors_found = 0;
@@ -76,6 +143,15 @@ unsigned int filenumbersize = 0;
 double gtimeread=0, gtimewrite=0, gbyteread=0, gbytewrite=0;     // total counts
 double gtimereadn=0, gtimewriten=0, gbytereadn=0, gbytewriten=0; // netto without small filling data, for speed calculations
 
+/* shared between writer and trailing verifier thread */
+pthread_mutex_t g_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_progress_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t g_output_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t g_verifier;
+unsigned int g_files_done = 0;  /* completed full block size files */
+int g_fill_finished = 0;
+volatile int g_stop = 0;        /* set on first error with --stop-on-error */
+
 /* return the current timestamp */
 static inline double timestamp(void)
 {
@@ -84,17 +160,731 @@ static inline double timestamp(void)
     return ((double)(tv.tv_sec) + (double)(tv.tv_usec/1e6));
 }
 
+/* block size record read by -v when no --block-size is given */
+#define BLOCKSIZE_RECORD "disk-filltest.blocksize"
+
 /* simple linear congruential random generator, faster than rand() and totally
  * sufficient for this cause. */
+#define LCG_MUL 0x27BB2EE687B0B0FDLLU
+#define LCG_ADD 0xB504F32DLU
+
 static inline uint64_t lcg_random(uint64_t *xn)
 {
-    *xn = 0x27BB2EE687B0B0FDLLU * *xn + 0xB504F32DLU;
+    *xn = LCG_MUL * *xn + LCG_ADD;
     return *xn;
 }
 
+/* n steps of the generator as one affine map x -> mul * x + add */
+struct lcg_jump
+{
+    uint64_t mul, add;
+};
+
+static struct lcg_jump lcg_jump_ahead(uint64_t n)
+{
+    struct lcg_jump r = { 1, 0 }, step = { LCG_MUL, LCG_ADD };
+
+    while (n)
+    {
+        if (n & 1) {
+            r.add = step.mul * r.add + step.add;
+            r.mul = step.mul * r.mul;
+        }
+        step.add = step.mul * step.add + step.add;
+        step.mul = step.mul * step.mul;
+        n >>= 1;
+    }
+
+    return r;
+}
+
 /* item type used in blocks written to disk */
 typedef uint64_t item_type;
 
+/* number of gopt_block_size blocks in each file, the last may be shorter */
+static inline unsigned int file_block_count(void)
+{
+    uint64_t filebytes = (uint64_t)gopt_file_size * 1024 * 1024;
+    return (unsigned int)((filebytes + gopt_block_size - 1) / gopt_block_size);
+}
+
+/* size of block blocknum of a file in bytes */
+static inline size_t file_block_size(unsigned int blocknum)
+{
+    uint64_t filebytes = (uint64_t)gopt_file_size * 1024 * 1024;
+    uint64_t blockpos = (uint64_t)blocknum * gopt_block_size;
+
+    if (filebytes - blockpos < gopt_block_size)
+        return (size_t)(filebytes - blockpos);
+    return gopt_block_size;
+}
+
+/* flush written data of fd to the disk */
+static inline int flush_file(int fd)
+{
+#ifdef _WIN32
+    return _commit(fd);
+#elif defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/* evict the cached pages of fd, so the following reads come from the disk.
+ * Dirty pages cannot be dropped, they are flushed first. Without
+ * posix_fadvise (Windows) reads may still be served from the cache. */
+static inline void drop_cache(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+    flush_file(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+}
+
+/* latency histogram with logarithmic buckets, 8 per power of two from 1 us */
+#define LATENCY_BUCKETS 256
+
+struct latency_hist
+{
+    uint64_t count[LATENCY_BUCKETS];
+    uint64_t total;
+    double max;
+};
+
+/* block latencies of the current pass */
+struct latency_hist g_write_latency, g_read_latency;
+
+/* flush latencies of the current pass and their total time */
+struct latency_hist g_flush_latency;
+double g_flush_time = 0;
+
+static void latency_add(struct latency_hist* h, double seconds)
+{
+    int bucket = 0;
+
+    if (seconds > 1e-6) bucket = (int)(8 * log2(seconds / 1e-6));
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+    ++h->count[bucket];
+    ++h->total;
+    if (seconds > h->max) h->max = seconds;
+}
+
+/* upper bound of the latency below which fraction p of the samples are */
+static double latency_percentile(const struct latency_hist* h, double p)
+{
+    uint64_t sum = 0;
+    int bucket;
+
+    if (h->total == 0) return 0;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+    {
+        sum += h->count[bucket];
+        if (sum >= p * h->total) break;
+    }
+
+    if (bucket == LATENCY_BUCKETS - 1) return h->max;
+    return fmin(1e-6 * pow(2.0, (bucket + 1) / 8.0), h->max);
+}
+
+/* files with errors in the current pass, for burn-in drift analysis */
+unsigned char* g_bad_files = NULL;
+unsigned int g_bad_files_size = 0;
+
+static void mark_bad_file(unsigned int filenum)
+{
+    if (filenum >= g_bad_files_size)
+    {
+        unsigned int size = filenum + 128;
+
+        g_bad_files = realloc(g_bad_files, size);
+        memset(g_bad_files + g_bad_files_size, 0, size - g_bad_files_size);
+        g_bad_files_size = size;
+    }
+
+    g_bad_files[filenum] = 1;
+}
+
+/* buffer arena: all I/O buffers are page aligned slots of one allocation made
+ * at startup, backed by huge pages when the system provides them */
+enum { ARENA_WRITE, ARENA_READ, ARENA_SMALL, ARENA_SLOTS };
+
+struct buffer_arena
+{
+    char* base;
+    size_t size;
+    size_t offset[ARENA_SLOTS];
+    size_t slot_size[ARENA_SLOTS];
+    const char* backing;
+};
+
+struct buffer_arena g_arena = { NULL, 0, { 0 }, { 0 }, "none" };
+
+#define ARENA_ALIGN (2 * 1024 * 1024)
+
+/* allocate the arena for blocks of blocksize and small blocks of smallsize */
+void arena_init(size_t blocksize, size_t smallsize)
+{
+    size_t slot = (blocksize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t small = (smallsize + 4095) & ~(size_t)4095;
+
+    g_arena.offset[ARENA_WRITE] = 0;
+    g_arena.offset[ARENA_READ] = slot;
+    g_arena.offset[ARENA_SMALL] = 2 * slot;
+    g_arena.slot_size[ARENA_WRITE] = g_arena.slot_size[ARENA_READ] = slot;
+    g_arena.slot_size[ARENA_SMALL] = small;
+    g_arena.size = (2 * slot + small + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+#if defined(__linux__)
+#ifdef MAP_HUGETLB
+    g_arena.base = mmap(NULL, g_arena.size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (g_arena.base != MAP_FAILED)
+        g_arena.backing = "explicit huge pages";
+    else
+#endif
+    {
+        /* over-allocate to align to the huge page size for THP */
+        char* p = mmap(NULL, g_arena.size + ARENA_ALIGN, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        g_arena.base = MAP_FAILED;
+        if (p != MAP_FAILED)
+        {
+            g_arena.base = (char*)(((uintptr_t)p + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+            g_arena.backing = "pages";
+#ifdef MADV_HUGEPAGE
+            if (madvise(g_arena.base, g_arena.size, MADV_HUGEPAGE) == 0)
+                g_arena.backing = "transparent huge pages";
+#endif
+        }
+    }
+    if (g_arena.base == MAP_FAILED) g_arena.base = NULL;
+#elif defined(_WIN32)
+    {
+        SIZE_T large = GetLargePageMinimum();
+
+        if (large != 0)
+        {
+            size_t size = (g_arena.size + large - 1) & ~(size_t)(large - 1);
+
+            /* needs the "Lock pages in memory" privilege */
+            g_arena.base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                        PAGE_READWRITE);
+            if (g_arena.base != NULL) {
+                g_arena.size = size;
+                g_arena.backing = "large pages";
+            }
+        }
+        if (g_arena.base == NULL)
+        {
+            g_arena.base = VirtualAlloc(NULL, g_arena.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            g_arena.backing = "pages";
+        }
+    }
+#else
+    if (posix_memalign((void**)&g_arena.base, 4096, g_arena.size) != 0) g_arena.base = NULL;
+    g_arena.backing = "pages";
+#endif
+
+    if (g_arena.base == NULL) {
+        printf("Error allocating %.1f MiB of buffers: %s\n",
+               g_arena.size / 1024.0 / 1024.0, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* fault everything in now, RSS stays fixed while testing */
+    memset(g_arena.base, 0, g_arena.size);
+
+    if (multicolor == 1)
+        printf("Buffer arena %.1f MiB with %s\n", g_arena.size / 1024.0 / 1024.0, g_arena.backing);
+}
+
+/* buffer of a slot for blocks up to size bytes */
+static inline item_type* arena_get(int slot, size_t size)
+{
+    if (size > g_arena.slot_size[slot]) {
+        printf("Error: %lu B block does not fit the %lu B buffer.\n",
+               (unsigned long)size, (unsigned long)g_arena.slot_size[slot]);
+        exit(EXIT_FAILURE);
+    }
+
+    return (item_type*)(g_arena.base + g_arena.offset[slot]);
+}
+
+/* fault injection for testing the error paths without a failing disk */
+#define FAULT_MAX_ENTRIES 64
+
+struct fault_location
+{
+    unsigned int filenum;
+    uint64_t offset;
+};
+
+struct fault_config
+{
+    int active;
+    double short_prob;              /* probability of a short transfer */
+    uint64_t enospc_bytes;          /* bytes written before ENOSPC, 0 = off */
+    uint64_t enospc_large;          /* same for writes above the sector size */
+    unsigned int delay_ms;          /* latency spike */
+    double delay_prob;
+    struct fault_location eio[FAULT_MAX_ENTRIES];
+    unsigned int eio_size;
+    struct fault_location weio[FAULT_MAX_ENTRIES];
+    unsigned int weio_size;
+    struct fault_location flip[FAULT_MAX_ENTRIES];
+    unsigned int flip_size;
+
+    uint64_t rnd;
+    uint64_t written;
+    unsigned int count_short, count_enospc, count_eio, count_flip, count_delay;
+    pthread_mutex_t lock;
+};
+
+struct fault_config g_fault = { 0 };
+
+/* sleep for some milliseconds */
+static void sleep_ms(unsigned int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* parse "<filenum>@<offset>" */
+static int fault_parse_location(const char* str, struct fault_location* loc,
+                                unsigned int* size)
+{
+    unsigned long long offset;
+
+    if (*size >= FAULT_MAX_ENTRIES) return 0;
+    if (sscanf(str, "%u@%llu", &loc[*size].filenum, &offset) != 2) return 0;
+
+    loc[(*size)++].offset = offset;
+    return 1;
+}
+
+/* parse one comma separated --fault specification, returns 0 on error */
+int fault_parse(const char* spec)
+{
+    char* copy = strdup(spec);
+    char* item;
+    int ok = 1;
+
+    for (item = strtok(copy, ","); item != NULL && ok; item = strtok(NULL, ","))
+    {
+        char* value = strchr(item, '=');
+        if (value == NULL) { ok = 0; break; }
+        *value++ = 0;
+
+        if (strcmp(item, "short") == 0)
+            ok = sscanf(value, "%lf", &g_fault.short_prob) == 1;
+        else if (strcmp(item, "enospc") == 0)
+            ok = sscanf(value, "%" SCNu64 "@%" SCNu64, &g_fault.enospc_bytes, &g_fault.enospc_large) >= 1;
+        else if (strcmp(item, "eio") == 0)
+            ok = fault_parse_location(value, g_fault.eio, &g_fault.eio_size);
+        else if (strcmp(item, "weio") == 0)
+            ok = fault_parse_location(value, g_fault.weio, &g_fault.weio_size);
+        else if (strcmp(item, "flip") == 0)
+            ok = fault_parse_location(value, g_fault.flip, &g_fault.flip_size);
+        else if (strcmp(item, "delay") == 0)
+            ok = sscanf(value, "%u@%lf", &g_fault.delay_ms, &g_fault.delay_prob) == 2;
+        else if (strcmp(item, "seed") == 0)
+            ok = sscanf(value, "%" SCNu64, &g_fault.rnd) == 1;
+        else
+            ok = 0;
+    }
+
+    free(copy);
+
+    if (ok && !g_fault.active) {
+        g_fault.active = 1;
+        pthread_mutex_init(&g_fault.lock, NULL);
+    }
+
+    return ok;
+}
+
+/* uniform random number in [0,1) from the injection generator */
+static double fault_random(void)
+{
+    return (lcg_random(&g_fault.rnd) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* common part of io_read and io_write: latency spikes and short transfers */
+static size_t fault_transfer(size_t count)
+{
+    unsigned int delay = 0;
+
+    pthread_mutex_lock(&g_fault.lock);
+    if (g_fault.delay_prob > 0 && fault_random() < g_fault.delay_prob) {
+        delay = g_fault.delay_ms;
+        ++g_fault.count_delay;
+    }
+    if (count > 1 && g_fault.short_prob > 0 && fault_random() < g_fault.short_prob) {
+        count = 1 + (size_t)(fault_random() * (count - 1));
+        ++g_fault.count_short;
+    }
+    pthread_mutex_unlock(&g_fault.lock);
+
+    if (delay) sleep_ms(delay);
+
+    return count;
+}
+
+/* write() with injected faults, offset is the position in file filenum */
+static ssize_t fault_write(int fd, const void* buf, size_t count,
+                        unsigned int filenum, uint64_t offset)
+{
+    ssize_t wb;
+    unsigned int i;
+    uint64_t limit;
+
+    if (!g_fault.active)
+        return write(fd, buf, count);
+
+    /* writes above the sector size may run out of space first, the way
+     * a fragmented file system still takes the -z tail fill */
+    limit = g_fault.enospc_bytes;
+    if (g_fault.enospc_large && count > (size_t)gopt_sector_size_in512 * 512 &&
+        (limit == 0 || g_fault.enospc_large < limit))
+        limit = g_fault.enospc_large;
+
+    count = fault_transfer(count);
+
+    for (i = 0; i < g_fault.weio_size; ++i)
+    {
+        if (g_fault.weio[i].filenum == filenum &&
+            g_fault.weio[i].offset >= offset && g_fault.weio[i].offset < offset + count)
+        {
+            pthread_mutex_lock(&g_fault.lock);
+            ++g_fault.count_eio;
+            pthread_mutex_unlock(&g_fault.lock);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    if (limit)
+    {
+        pthread_mutex_lock(&g_fault.lock);
+        if (g_fault.written >= limit) {
+            ++g_fault.count_enospc;
+            pthread_mutex_unlock(&g_fault.lock);
+            errno = ENOSPC;
+            return -1;
+        }
+        if (count > limit - g_fault.written)
+            count = limit - g_fault.written;
+        pthread_mutex_unlock(&g_fault.lock);
+    }
+
+    wb = write(fd, buf, count);
+
+    if (wb > 0)
+    {
+        pthread_mutex_lock(&g_fault.lock);
+        g_fault.written += wb;
+        pthread_mutex_unlock(&g_fault.lock);
+    }
+
+    return wb;
+}
+
+/* read() with injected faults, offset is the position in file filenum */
+static ssize_t fault_read(int fd, void* buf, size_t count,
+                       unsigned int filenum, uint64_t offset)
+{
+    ssize_t rb;
+    unsigned int i;
+
+    if (!g_fault.active)
+        return read(fd, buf, count);
+
+    count = fault_transfer(count);
+
+    for (i = 0; i < g_fault.eio_size; ++i)
+    {
+        if (g_fault.eio[i].filenum == filenum &&
+            g_fault.eio[i].offset >= offset && g_fault.eio[i].offset < offset + count)
+        {
+            pthread_mutex_lock(&g_fault.lock);
+            ++g_fault.count_eio;
+            pthread_mutex_unlock(&g_fault.lock);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    rb = read(fd, buf, count);
+
+    for (i = 0; i < g_fault.flip_size && rb > 0; ++i)
+    {
+        if (g_fault.flip[i].filenum == filenum &&
+            g_fault.flip[i].offset >= offset && g_fault.flip[i].offset < offset + rb)
+        {
+            ((unsigned char*)buf)[g_fault.flip[i].offset - offset] ^= 1;
+            pthread_mutex_lock(&g_fault.lock);
+            ++g_fault.count_flip;
+            pthread_mutex_unlock(&g_fault.lock);
+        }
+    }
+
+    return rb;
+}
+
+/* binary I/O trace: one record per read, write and flush. The hot path only
+ * appends to a lock-free ring buffer, a background thread writes it out */
+#define TRACE_MAGIC "DFTTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 65536   /* records, power of two */
+
+enum { TRACE_READ = 1, TRACE_WRITE = 2, TRACE_FLUSH = 3 };
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t seed;
+    uint32_t reserved;
+};
+
+struct trace_record
+{
+    uint64_t timestamp_us;      /* since start of trace */
+    uint64_t op_offset;         /* operation in the top 8 bits, file offset */
+    uint32_t filenum;
+    uint32_t size;              /* requested bytes */
+    uint32_t latency_us;
+    int32_t result;             /* bytes transferred or -errno */
+};
+
+struct trace_slot
+{
+    uint64_t sequence;
+    struct trace_record record;
+};
+
+struct trace_state
+{
+    int active;
+    FILE* file;
+    double start;
+    struct trace_slot* ring;
+    uint64_t tail;              /* next slot for producers */
+    uint64_t head;              /* next slot for the writer thread */
+    uint64_t written, dropped;
+    volatile int stop;
+    pthread_t thread;
+};
+
+struct trace_state g_trace = { 0 };
+
+/* append one record, drops it if the ring buffer is full */
+static void trace_append(int op, double ts, double latency, unsigned int filenum,
+                         uint64_t offset, size_t size, ssize_t result)
+{
+    uint64_t pos = __atomic_load_n(&g_trace.tail, __ATOMIC_RELAXED);
+    struct trace_slot* slot;
+
+    while (1)
+    {
+        int64_t diff;
+
+        slot = &g_trace.ring[pos & (TRACE_RING_SIZE - 1)];
+        diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_trace.tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            __atomic_fetch_add(&g_trace.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&g_trace.tail, __ATOMIC_RELAXED);
+    }
+
+    slot->record.timestamp_us = (uint64_t)((ts - g_trace.start) * 1e6);
+    slot->record.op_offset = ((uint64_t)op << 56) | (offset & 0x00FFFFFFFFFFFFFFLLU);
+    slot->record.filenum = filenum;
+    slot->record.size = (uint32_t)size;
+    slot->record.latency_us = (uint32_t)(latency * 1e6);
+    slot->record.result = (int32_t)(result < 0 ? -errno : result);
+
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* background thread writing the ring buffer to the trace file */
+static void* trace_thread(void* arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        struct trace_slot* slot = &g_trace.ring[g_trace.head & (TRACE_RING_SIZE - 1)];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == g_trace.head + 1)
+        {
+            fwrite(&slot->record, sizeof(slot->record), 1, g_trace.file);
+            __atomic_store_n(&slot->sequence, g_trace.head + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+            ++g_trace.head;
+            ++g_trace.written;
+        }
+        else if (g_trace.stop)
+            break;
+        else
+            sleep_ms(1);
+    }
+
+    return NULL;
+}
+
+/* start tracing into filename */
+void trace_start(const char* filename)
+{
+    struct trace_header header;
+    uint64_t i;
+
+    g_trace.file = fopen(filename, "wb");
+    if (g_trace.file == NULL) {
+        printf("Error opening trace %s: %s\n", filename, strerror(errno));
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 8);
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    header.seed = g_seed;
+    fwrite(&header, sizeof(header), 1, g_trace.file);
+
+    g_trace.ring = malloc(sizeof(struct trace_slot) * TRACE_RING_SIZE);
+    for (i = 0; i < TRACE_RING_SIZE; ++i)
+        g_trace.ring[i].sequence = i;
+
+    g_trace.start = timestamp();
+
+    if (pthread_create(&g_trace.thread, NULL, trace_thread, NULL) != 0) {
+        printf("Error starting trace thread.\n");
+        fclose(g_trace.file);
+        free(g_trace.ring);
+        return;
+    }
+
+    g_trace.active = 1;
+}
+
+/* drain the ring buffer and close the trace */
+void trace_finish(void)
+{
+    if (!g_trace.active) return;
+
+    g_trace.active = 0;
+    g_trace.stop = 1;
+    pthread_join(g_trace.thread, NULL);
+
+    fclose(g_trace.file);
+    free(g_trace.ring);
+
+    printf("Traced %" PRIu64 " I/Os", g_trace.written);
+    if (g_trace.dropped) printf(", %" PRIu64 " dropped with full buffer", g_trace.dropped);
+    printf("\n");
+}
+
+/* write() with fault injection and tracing */
+static ssize_t io_write(int fd, const void* buf, size_t count,
+                        unsigned int filenum, uint64_t offset)
+{
+    double ts;
+    ssize_t wb;
+
+    if (!g_trace.active)
+        return fault_write(fd, buf, count, filenum, offset);
+
+    ts = timestamp();
+    wb = fault_write(fd, buf, count, filenum, offset);
+    trace_append(TRACE_WRITE, ts, timestamp() - ts, filenum, offset, count, wb);
+
+    return wb;
+}
+
+/* read() with fault injection and tracing */
+static ssize_t io_read(int fd, void* buf, size_t count,
+                       unsigned int filenum, uint64_t offset)
+{
+    double ts;
+    ssize_t rb;
+
+    if (!g_trace.active)
+        return fault_read(fd, buf, count, filenum, offset);
+
+    ts = timestamp();
+    rb = fault_read(fd, buf, count, filenum, offset);
+    trace_append(TRACE_READ, ts, timestamp() - ts, filenum, offset, count, rb);
+
+    return rb;
+}
+
+/* read a whole block unless the file ends or an error occurs */
+static ssize_t read_block(int fd, void* buf, size_t count,
+                          unsigned int filenum, uint64_t offset)
+{
+    size_t rp = 0;
+
+    while (rp < count)
+    {
+        ssize_t rb = io_read(fd, (char*)buf + rp, count - rp, filenum, offset + rp);
+
+        if (rb < 0) return rp ? (ssize_t)rp : rb;
+        if (rb == 0) break;
+
+        rp += rb;
+    }
+
+    return rp;
+}
+
+/* write a whole block unless an error occurs */
+static ssize_t write_block(int fd, const void* buf, size_t count,
+                           unsigned int filenum, uint64_t offset)
+{
+    size_t wp = 0;
+
+    while (wp < count)
+    {
+        ssize_t wb = io_write(fd, (const char*)buf + wp, count - wp, filenum, offset + wp);
+
+        if (wb <= 0) return wp ? (ssize_t)wp : -1;
+
+        wp += wb;
+    }
+
+    return wp;
+}
+
+/* print number of injected faults */
+void fault_summary(void)
+{
+    if (!g_fault.active) return;
+
+    printf("Injected faults: %u short transfers, %u ENOSPC, %u EIO, %u bit flips, %u delays\n",
+           g_fault.count_short, g_fault.count_enospc, g_fault.count_eio,
+           g_fault.count_flip, g_fault.count_delay);
+}
+
 /* a list of open file handles */
 int* g_filehandle = NULL;
 unsigned int g_filehandle_size = 0;
@@ -160,6 +950,8 @@ const char *formatNumber (
 /* append to the list of open file handles */
 static inline void filehandle_append(int fd)
 {
+    pthread_mutex_lock(&g_progress_lock);
+
     if (g_filehandle_size >= g_filehandle_limit)
     {
         g_filehandle_limit *= 2;
@@ -169,6 +961,20 @@ static inline void filehandle_append(int fd)
     }
 
     g_filehandle[ g_filehandle_size++ ] = fd;
+
+    pthread_mutex_unlock(&g_progress_lock);
+}
+
+/* get handle of an immediately unlinked file, -1 if there is none */
+static inline int filehandle_get(unsigned int filenum)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&g_progress_lock);
+    if (filenum < g_filehandle_size) fd = g_filehandle[filenum];
+    pthread_mutex_unlock(&g_progress_lock);
+
+    return fd;
 }
 
 /* for compatibility with windows, use O_BINARY if available */
@@ -191,6 +997,7 @@ void consoleColor ( char color[20] )
     idea from
     https://stackoverflow.com/questions/13280895/how-can-i-use-colors-in-my-console-app-c
 */
+#ifdef _WIN32
     int colorvalue;
 
     switch ( *color ) {
@@ -215,7 +1022,21 @@ void consoleColor ( char color[20] )
         }
 
     if ( multicolor == 1 ) SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), colorvalue );
+#else
+    /* same colors as ANSI escape sequences */
+    const char* colorcode = "\033[0m";
+
+    switch ( *color ) {
+        case 'b': colorcode = "\033[1;37m"; break;
+        case 'c': colorcode = "\033[1;36m"; break;
+        case 'g': colorcode = "\033[1;32m"; break;
+        case 'r': colorcode = "\033[1;31m"; break;
+        case 'w': colorcode = "\033[0m";    break;
+        case 'y': colorcode = "\033[1;33m"; break;
+        }
 
+    if ( multicolor == 1 ) printf("%s", colorcode);
+#endif
 }
 
 /* print command line usage */
@@ -225,6 +1046,16 @@ void print_usage(char* argv[])
     fprintf(stderr,
             "Usage: %s  [-v]  [-C dir] [-g | -s seed] [-S file_size] \n"
             "                          [-f files] [-z | -d block_size] [-u] [-U] [-m]\n"
+            "                          [--verify-lag n [--verify-final]] [--stop-on-error]\n"
+            "                          [--block-size KiB | auto [--tune-size MiB]]\n"
+            "                          [--cleanup-threads n] [--discard] [--forensic]\n"
+            "                          [--fault spec] [--passes n] [--duration minutes]\n"
+            "                          [--drift percent] [--retention]\n"
+            "                          [--flush-every MiB] [--flush-file-end]\n"
+            "                          [--history file [--compare]]\n"
+            "                          [--trace file | --replay file [--replay-timing]]\n"
+            "                          [--metadata files [--md-size B] [--md-shards n]\n"
+            "                           [--md-threads n]] [--device-stats]\n"
             "Version 0.8.0W\n"
             "Options: \n"
             "  -v                Verify existing data files.\n"
@@ -234,117 +1065,695 @@ void print_usage(char* argv[])
             "  -S <file size>    Size of each file in MiB (default=1024).\n"
             "  -f <file number>  Only write this number of files.\n"
             "  -z                Fill disk with smaller blocks. Other way program fills\n"
-            "                           in 1 MiB blocks.     Mutually exclusive with -f. \n"
+            "                           in --block-size blocks. Mutually exclusive with -f.\n"
             "  -d <block size>   Smaller block in 512 B: 4096 B = (block size=8) * 512,\n"
             "                           default=8 (4 KiB). Mutually exclusive with -f.\n"
             "  -u                Remove files after _successful_ test (works with -v).\n"
             "  -U                Immediately remove files, write and verify via file handles\n"
             "                           (not for Windows).\n"
             "  -m                Multicolor detailed output, for dark background.\n"
+            "  --verify-lag <n>  Verify files while writing, n >= 1 files behind the writer.\n"
+            "                           Each file is flushed before it is verified.\n"
+            "  --verify-final    With --verify-lag: verify all files again at the end.\n"
+            "  --stop-on-error   Stop writing and verifying at the first bad block.\n"
+            "  --block-size <KiB>  Transfer block size in KiB (default=1024). With auto\n"
+            "                           probe 64 KiB to 16 MiB and use the fastest one.\n"
+            "                           The size is recorded for later -v runs.\n"
+            "  --tune-size <MiB> Size of each auto tuning probe file (default=1024),\n"
+            "                           larger than the cache of the device.\n"
+            "  --cleanup-threads <n>  Remove old files with n threads (default=4).\n"
+            "  --discard         Punch holes / trim files before removing them, so SSDs\n"
+            "                           can reclaim the space (FITRIM needs root on Linux).\n"
+            "  --forensic        Classify bad blocks (bit flips, zero, ones, pattern) and\n"
+            "                           find the file and offset their data belongs to.\n"
+            "                           Misplaced sectors are found at -d sector granularity\n"
+            "                           up to 256 MiB of index, coarser on larger disks.\n"
+            "  --fault <spec>    Inject faults for testing, comma separated list of\n"
+            "                           short=<probability>  enospc=<bytes>[@<large bytes>]\n"
+            "                           eio=<file>@<offset> (read)  weio=<file>@<offset> (write)\n"
+            "                           flip=<file>@<offset>\n"
+            "                           delay=<ms>@<probability>  seed=<number>\n"
+            "  --passes <n>      Burn-in: repeat writing and verifying n times with a new\n"
+            "                           seed each pass and compare the passes.\n"
+            "  --duration <min>  Burn-in: repeat passes for this many minutes.\n"
+            "  --drift <percent> Flag passes slower than the first one by more than this\n"
+            "                           (default=10).\n"
+            "  --retention       Burn-in: write once, later passes only verify.\n"
+            "  --flush-every <MiB>  Flush written data to the disk every n MiB and report\n"
+            "                           flush latencies and durable write speed.\n"
+            "  --flush-file-end  Flush at the end of each file.\n"
+            "  --history <file>  Append device identity, options and results of this run\n"
+            "                           to a history file.\n"
+            "  --compare         Compare this run against earlier runs of the same device\n"
+            "                           in the history and flag significant regressions.\n"
+            "  --trace <file>    Record every read, write and flush in a binary trace.\n"
+            "  --replay <file>   Issue the I/Os of a trace again, as fast as possible.\n"
+            "  --replay-timing   Replay with the recorded timing.\n"
+            "  --metadata <n>    Metadata test instead of filling: create, stat, verify\n"
+            "                           and remove n small files, report ops/s.\n"
+            "  --md-size <B>     Size of each metadata test file (default=4096).\n"
+            "  --md-shards <n>   Spread metadata test files over n directories\n"
+            "                           (default=256).\n"
+            "  --md-threads <n>  Metadata test threads (default=1).\n"
+            "  --device-stats    Show device side throughput, queue depth, utilization\n"
+            "                           and merges of the disk next to the tool's speed.\n"
             "\n"
             "The program will fill the current directory with files called random-XXXXXXXX.\n"
             "Each file is up to 1 GiB (modified with -S) in size and contains randomly\n"
-            "generated integers. When there is less then 1 MiB space left (modified \n"
+            "generated integers. When there is less then one block left (modified \n"
             "with -z; with -d set your cluster size) writing finishes and files are read.\n"
             "Read file contents are checked: every change will output an error. \n"
             "Reading and writing speeds are shown.\n"
             ,argv[0]);
 
-    exit(EXIT_FAILURE);
-}
-
-/* parse command line parameters */
-void parse_commandline(int argc, char* argv[])
-{
-    int opt;
-    char separated_number[50];
+    exit(EXIT_FAILURE);
+}
+
+/* path of a file option relative to the directory the program was started
+ * in, not the -C directory */
+static char* startdir_path(const char* startdir, const char* path)
+{
+    char* result = malloc(strlen(startdir) + strlen(path) + 2);
+
+    if (path[0] == '/' || path[0] == '\\' || startdir[0] == 0 || strchr(path, ':'))
+        strcpy(result, path);
+    else
+        sprintf(result, "%s/%s", startdir, path);
+
+    return result;
+}
+
+/* parse command line parameters */
+void parse_commandline(int argc, char* argv[])
+{
+    int opt;
+    char separated_number[50];
+
+    enum { OPT_VERIFY_LAG = 256, OPT_VERIFY_FINAL, OPT_STOP_ON_ERROR,
+           OPT_BLOCK_SIZE, OPT_TUNE_SIZE, OPT_CLEANUP_THREADS, OPT_DISCARD,
+           OPT_FORENSIC, OPT_FAULT, OPT_PASSES, OPT_DURATION, OPT_DRIFT,
+           OPT_RETENTION, OPT_FLUSH_EVERY, OPT_FLUSH_FILE_END, OPT_HISTORY,
+           OPT_COMPARE, OPT_TRACE, OPT_REPLAY, OPT_REPLAY_TIMING, OPT_METADATA,
+           OPT_MD_SIZE, OPT_MD_SHARDS, OPT_MD_THREADS, OPT_DEVICE_STATS };
+    int passes_set = 0;
+    char startdir[PATH_MAX] = "";
+
+    if (getcwd(startdir, sizeof(startdir)) == NULL) startdir[0] = 0;
+
+    static const struct option long_options[] = {
+        { "verify-lag",    required_argument, NULL, OPT_VERIFY_LAG },
+        { "verify-final",  no_argument,       NULL, OPT_VERIFY_FINAL },
+        { "stop-on-error", no_argument,       NULL, OPT_STOP_ON_ERROR },
+        { "block-size",    required_argument, NULL, OPT_BLOCK_SIZE },
+        { "tune-size",     required_argument, NULL, OPT_TUNE_SIZE },
+        { "cleanup-threads", required_argument, NULL, OPT_CLEANUP_THREADS },
+        { "discard",       no_argument,       NULL, OPT_DISCARD },
+        { "forensic",      no_argument,       NULL, OPT_FORENSIC },
+        { "fault",         required_argument, NULL, OPT_FAULT },
+        { "passes",        required_argument, NULL, OPT_PASSES },
+        { "duration",      required_argument, NULL, OPT_DURATION },
+        { "drift",         required_argument, NULL, OPT_DRIFT },
+        { "retention",     no_argument,       NULL, OPT_RETENTION },
+        { "flush-every",   required_argument, NULL, OPT_FLUSH_EVERY },
+        { "flush-file-end", no_argument,      NULL, OPT_FLUSH_FILE_END },
+        { "history",       required_argument, NULL, OPT_HISTORY },
+        { "compare",       no_argument,       NULL, OPT_COMPARE },
+        { "trace",         required_argument, NULL, OPT_TRACE },
+        { "replay",        required_argument, NULL, OPT_REPLAY },
+        { "replay-timing", no_argument,       NULL, OPT_REPLAY_TIMING },
+        { "metadata",      required_argument, NULL, OPT_METADATA },
+        { "md-size",       required_argument, NULL, OPT_MD_SIZE },
+        { "md-shards",     required_argument, NULL, OPT_MD_SHARDS },
+        { "md-threads",    required_argument, NULL, OPT_MD_THREADS },
+        { "device-stats",  no_argument,       NULL, OPT_DEVICE_STATS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "vC:gs:S:f:zd:uUmh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_VERIFY_LAG:
+            gopt_verify_lag = atoi(optarg);
+            if (gopt_verify_lag == 0) print_usage(argv);
+            break;
+        case OPT_VERIFY_FINAL:
+            gopt_verify_final = 1;
+            break;
+        case OPT_STOP_ON_ERROR:
+            gopt_stop_on_error = 1;
+            break;
+        case OPT_BLOCK_SIZE:
+            if (strcmp(optarg, "auto") == 0) {
+                gopt_block_size_tune = 1;
+                break;
+            }
+            if (atoi(optarg) <= 0 || atoi(optarg) > 1024 * 1024) print_usage(argv);
+            gopt_block_size = atoi(optarg) * 1024;
+            gopt_block_size_set = 1;
+            break;
+        case OPT_TUNE_SIZE:
+            gopt_tune_size = atoi(optarg);
+            if (gopt_tune_size == 0) print_usage(argv);
+            break;
+        case OPT_CLEANUP_THREADS:
+            gopt_cleanup_threads = atoi(optarg);
+            if (gopt_cleanup_threads == 0) print_usage(argv);
+            break;
+        case OPT_DISCARD:
+            gopt_discard = 1;
+            break;
+        case OPT_FORENSIC:
+            gopt_forensic = 1;
+            break;
+        case OPT_FAULT:
+            if (!fault_parse(optarg)) {
+                fprintf(stderr, "Invalid fault specification: %s\n", optarg);
+                print_usage(argv);
+            }
+            break;
+        case OPT_PASSES:
+            gopt_passes = atoi(optarg);
+            if (gopt_passes == 0) print_usage(argv);
+            passes_set = 1;
+            break;
+        case OPT_DURATION:
+            gopt_duration = atoi(optarg);
+            if (gopt_duration == 0) print_usage(argv);
+            break;
+        case OPT_DRIFT:
+            gopt_drift = atof(optarg);
+            break;
+        case OPT_RETENTION:
+            gopt_retention = 1;
+            break;
+        case OPT_FLUSH_EVERY:
+            gopt_flush_every = atoi(optarg);
+            if (gopt_flush_every == 0) print_usage(argv);
+            break;
+        case OPT_FLUSH_FILE_END:
+            gopt_flush_file_end = 1;
+            break;
+        case OPT_HISTORY:
+            gopt_history = startdir_path(startdir, optarg);
+            break;
+        case OPT_TRACE:
+            gopt_trace = startdir_path(startdir, optarg);
+            break;
+        case OPT_REPLAY:
+            gopt_replay = startdir_path(startdir, optarg);
+            break;
+        case OPT_REPLAY_TIMING:
+            gopt_replay_timing = 1;
+            break;
+        case OPT_METADATA:
+            gopt_md_files = atoi(optarg);
+            if (gopt_md_files == 0) print_usage(argv);
+            break;
+        case OPT_MD_SIZE:
+            gopt_md_size = atoi(optarg);
+            if (gopt_md_size == 0) print_usage(argv);
+            break;
+        case OPT_MD_SHARDS:
+            gopt_md_shards = atoi(optarg);
+            if (gopt_md_shards == 0 || gopt_md_shards > 10000) print_usage(argv);
+            break;
+        case OPT_MD_THREADS:
+            gopt_md_threads = atoi(optarg);
+            if (gopt_md_threads == 0) print_usage(argv);
+            break;
+        case OPT_DEVICE_STATS:
+            gopt_device_stats = 1;
+            break;
+        case OPT_COMPARE:
+            gopt_compare = 1;
+            break;
+        case 's':
+            g_seed = atoi(optarg);
+            break;
+         case 'g':
+            g_seed = time(NULL);
+            break;
+        case 'S':
+            gopt_file_size = atoi(optarg) ;
+            break;
+        case 'z':  //zero space left
+            fulfill = 1 ;
+            break;
+        case 'd':
+            gopt_sector_size_in512 = atoi(optarg) ;
+            fulfill = 1 ;
+            break;
+        case 'm':
+            multicolor = 1 ;
+            break;
+        case 'f':
+            gopt_file_limit = atoi(optarg);
+            break;
+        case 'v':
+            gopt_readonly = 1;
+            break;
+        case 'u':
+            gopt_unlink_after = 1;
+            break;
+        case 'U':
+            gopt_unlink_immediate = 1;
+            break;
+        case 'C':
+            if (chdir(optarg) != 0) {
+                printf("Error chdir to %s: %s\n", optarg, strerror(errno));
+            }
+            break;
+        case 'h':
+        default:
+            print_usage(argv);
+        }
+    }
+
+    if ( gopt_duration != 0 && !passes_set ) gopt_passes = 0;
+
+    if ( gopt_compare && gopt_history == NULL ) print_usage(argv);
+
+    if ( gopt_file_limit != UINT_MAX ) fulfill = 0; //other way, after set number of big files, filling up big disk with small block could take ages, make too much stress and cause other problems
+
+    if (optind < argc)
+        print_usage(argv);
+
+    //for formating position numbers
+    filenumbersize = strlen( formatNumbernospac ( (uint64_t) gopt_file_size * 1024 * 1024 , separated_number + 22) );
+}
+
+/* list numbers of all random-XXXXXXXX files in the current directory, also
+ * the ones after gaps. Returns count, *list must be freed by the caller. */
+unsigned int list_randfiles(unsigned int** list)
+{
+    DIR* dir;
+    struct dirent* de;
+    unsigned int size = 0, limit = 0;
+
+    *list = NULL;
+
+    dir = opendir(".");
+    if (dir == NULL) {
+        printf("Error listing directory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        unsigned int filenum;
+        int len = 0;
+
+        if (strlen(de->d_name) != 15 || strspn(de->d_name + 7, "0123456789") != 8)
+            continue;
+        if (sscanf(de->d_name, "random-%8u%n", &filenum, &len) != 1 || len != 15)
+            continue;
+
+        if (size >= limit)
+        {
+            limit *= 2;
+            if (limit < 128) limit = 128;
+
+            *list = realloc(*list, sizeof(unsigned int) * limit);
+        }
+
+        (*list)[ size++ ] = filenum;
+    }
+
+    closedir(dir);
+
+    return size;
+}
+
+/* let the disk reclaim the blocks of a file before it is removed */
+static int discard_file(const char* filename)
+{
+    int fd, ret = -1;
+    struct stat st;
+
+    fd = open(filename, O_RDWR | O_BINARY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+#elif defined(_WIN32) && defined(FSCTL_FILE_LEVEL_TRIM)
+        FILE_LEVEL_TRIM trim;
+        DWORD bytes;
+
+        trim.Key = 0;
+        trim.NumRanges = 1;
+        trim.Ranges[0].Offset = 0;
+        trim.Ranges[0].Length = st.st_size;
+
+        ret = DeviceIoControl((HANDLE)_get_osfhandle(fd), FSCTL_FILE_LEVEL_TRIM,
+                              &trim, sizeof(trim), NULL, 0, &bytes, NULL) ? 0 : -1;
+#endif
+    }
+    else ret = 0;
+
+    close(fd);
+    return ret;
+}
+
+/* work shared by the cleanup threads */
+struct cleanup_work
+{
+    unsigned int* list;
+    unsigned int size;
+    unsigned int next;
+    int discard;            /* 1 = discard pass, 0 = unlink pass */
+    unsigned int done;
+    unsigned int failed;
+    pthread_mutex_t lock;
+};
+
+static void* cleanup_thread(void* arg)
+{
+    struct cleanup_work* work = arg;
+
+    while (1)
+    {
+        unsigned int idx;
+        int ret;
+        char filename[32];
+
+        pthread_mutex_lock(&work->lock);
+        idx = work->next++;
+        pthread_mutex_unlock(&work->lock);
+
+        if (idx >= work->size) break;
+
+        snprintf(filename, sizeof(filename), "random-%08u", work->list[idx]);
+
+        if (work->discard)
+            ret = discard_file(filename);
+        else
+            ret = unlink(filename);
+
+        pthread_mutex_lock(&work->lock);
+        if (ret == 0) ++work->done; else ++work->failed;
+        pthread_mutex_unlock(&work->lock);
+    }
+
+    return NULL;
+}
+
+/* run one cleanup pass over the file list with gopt_cleanup_threads */
+static void cleanup_pass(struct cleanup_work* work, int discard)
+{
+    pthread_t* threads = malloc(sizeof(pthread_t) * gopt_cleanup_threads);
+    unsigned int t, started = 0;
+
+    work->next = 0;
+    work->discard = discard;
+    work->done = work->failed = 0;
+
+    for (t = 0; t < gopt_cleanup_threads; ++t)
+    {
+        if (pthread_create(&threads[t], NULL, cleanup_thread, work) != 0) break;
+        ++started;
+    }
+
+    if (started == 0) cleanup_thread(work);
+
+    for (t = 0; t < started; ++t)
+        pthread_join(threads[t], NULL);
+
+    free(threads);
+}
+
+/* unlink (delete) old random files */
+void unlink_randfiles(void)
+{
+    struct cleanup_work work;
+    double ts1, ts2, ts3, discard_time;
+
+    consoleColor("red");
+
+    work.size = list_randfiles(&work.list);
+    pthread_mutex_init(&work.lock, NULL);
+
+    ts1 = timestamp();
+
+    if (work.size > 0 && gopt_discard)
+    {
+        printf("Discarding old files ...");
+        fflush(stdout);
+
+        cleanup_pass(&work, 1);
+
+        if (work.failed == 0)
+            printf(" total: %u.\n", work.done);
+        else
+            printf(" total: %u, not supported or failed: %u.\n", work.done, work.failed);
+    }
+
+    ts2 = timestamp();
+    discard_time = ts2 - ts1;
+
+    if (work.size > 0)
+    {
+        printf("Removing old files ...");
+        fflush(stdout);
+
+        cleanup_pass(&work, 0);
+
+        if (work.failed == 0)
+            printf(" total: %u.\n", work.done);
+        else
+            printf(" total: %u, failed: %u.\n", work.done, work.failed);
+    }
+
+    ts3 = timestamp();
+
+#if defined(__linux__) && defined(FITRIM)
+    if (work.size > 0 && gopt_discard)
+    { /* tell the disk about the freed blocks of the whole file system */
+        struct fstrim_range range;
+        int fd = open(".", O_RDONLY);
+        double ts = timestamp();
+
+        range.start = 0;
+        range.len = ULLONG_MAX;
+        range.minlen = 0;
+
+        if (fd >= 0 && ioctl(fd, FITRIM, &range) == 0)
+            printf("Trimmed %.3f MB of free space.\n", range.len / 1000.0 / 1000.0);
+        else
+            printf("STATUS trimming file system: %s\n", strerror(errno));
+
+        if (fd >= 0) close(fd);
+
+        discard_time += timestamp() - ts;
+    }
+#endif
+
+    if (work.size > 0)
+    {
+        printf("Cleanup took %.3f s with %u threads", timestamp() - ts1, gopt_cleanup_threads);
+        if (gopt_discard) printf(", discard %.3f s, unlink %.3f s", discard_time, ts3 - ts2);
+        printf(".\n");
+    }
+
+    pthread_mutex_destroy(&work.lock);
+    free(work.list);
+
+    unlink(BLOCKSIZE_RECORD);
+
+    consoleColor("white");
+}
+
+/* flush fd and record the flush latency */
+static void timed_flush(int fd, unsigned int filenum, const char* filename)
+{
+    double ts = timestamp();
+    int ret = flush_file(fd);
+
+    if (g_trace.active)
+        trace_append(TRACE_FLUSH, ts, timestamp() - ts, filenum, 0, 0, ret);
+
+    if (ret != 0) {
+        printf("Error flushing file %s: %s\n", filename, strerror(errno));
+        return;
+    }
+
+    ts = timestamp() - ts;
+    latency_add(&g_flush_latency, ts);
+    g_flush_time += ts;
+}
+
+/* flush latency distribution and buffered against durable throughput */
+void flush_summary(void)
+{
+    const struct latency_hist* h = &g_flush_latency;
+
+    if (h->total == 0) return;
+
+    printf("Flushed %" PRIu64 " times, latency p50 % 9.3f  p90 % 9.3f  p99 % 9.3f  max % 9.3f ms\n",
+           h->total, latency_percentile(h, 0.5) * 1000, latency_percentile(h, 0.9) * 1000,
+           latency_percentile(h, 0.99) * 1000, h->max * 1000);
+
+    if (gtimewriten - g_flush_time > 0 && gtimewriten > 0)
+        printf("Buffered write % 12.3f MB/s, durable write % 12.3f MB/s, %.1f %% of time flushing\n",
+               gbytewriten / 1000 / 1000 / (gtimewriten - g_flush_time),
+               gbytewriten / 1000 / 1000 / gtimewriten,
+               100.0 * g_flush_time / gtimewriten);
+
+    fflush(stdout);
+}
+
+/* bytes of the next probe transfer at pos: up to the end of the block, and
+ * never past the probe size even when the block is larger */
+static size_t probe_transfer(uint64_t pos, unsigned int blocksize, uint64_t probebytes)
+{
+    uint64_t count = blocksize - pos % blocksize;
+
+    return (size_t)(count < probebytes - pos ? count : probebytes - pos);
+}
+
+/* write and read a probe file with each block size from 64 KiB to 16 MiB and
+ * set gopt_block_size to the one with the best write+read throughput. The
+ * probe goes through the fault layer but not the trace, it is no random file
+ * to replay; eio and flip never match its file number */
+void tune_block_size(void)
+{
+    const char* filename = "random-probe";
+    unsigned int blocksize, best_size = gopt_block_size;
+    double best_rate = 0;
+    uint64_t probebytes = (uint64_t)gopt_tune_size * 1024 * 1024;
+
+    item_type* block = arena_get(ARENA_WRITE, 16 * 1024 * 1024);
+
+    consoleColor("brightWhite");
+    printf("Tuning block size with %u MiB probe files\n", gopt_tune_size);
+    consoleColor("white");
+
+    for (blocksize = 64 * 1024; blocksize <= 16 * 1024 * 1024; blocksize *= 2)
+    {
+        int fd, failed = 0;
+        uint64_t pos;
+        ssize_t rb, wb;
+        unsigned int i;
+        uint64_t rnd = g_seed;
+        double ts1, ts2, ts3, ts4, rate;
+
+        for (i = 0; i < blocksize / sizeof(item_type); ++i)
+            block[i] = lcg_random(&rnd);
+
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
+        if (fd < 0) {
+            printf("Error opening probe file %s: %s\n", filename, strerror(errno));
+            break;
+        }
+
+        ts1 = timestamp();
+
+        for (pos = 0; pos < probebytes && !failed; pos += wb)
+        {
+            wb = fault_write(fd, block, probe_transfer(pos, blocksize, probebytes), UINT_MAX, pos);
+            if (wb <= 0) { failed = 1; break; }
+        }
+
+        if (!failed && flush_file(fd) != 0) failed = 1;
+
+        ts2 = timestamp();
+
+        /* read the probe back from the disk, not from the page cache */
+        drop_cache(fd);
 
-    while ((opt = getopt(argc, argv, "vC:gs:S:f:zd:uUmh")) != -1) {
-        switch (opt) {
-        case 's':
-            g_seed = atoi(optarg);
-            break;
-         case 'g':
-            g_seed = time(NULL);
-            break;
-        case 'S':
-            gopt_file_size = atoi(optarg) ;
-            break;
-        case 'z':  //zero space left
-            fulfill = 1 ;
-            break;
-        case 'd':
-            gopt_sector_size_in512 = atoi(optarg) ;
-            fulfill = 1 ;
-            break;
-        case 'm':
-            multicolor = 1 ;
-            break;
-        case 'f':
-            gopt_file_limit = atoi(optarg);
-            break;
-        case 'v':
-            gopt_readonly = 1;
-            break;
-        case 'u':
-            gopt_unlink_after = 1;
-            break;
-        case 'U':
-            gopt_unlink_immediate = 1;
-            break;
-        case 'C':
-            if (chdir(optarg) != 0) {
-                printf("Error chdir to %s: %s\n", optarg, strerror(errno));
-            }
+        ts3 = timestamp();
+
+        if (!failed && lseek(fd, 0, SEEK_SET) != 0) failed = 1;
+
+        for (pos = 0; pos < probebytes && !failed; pos += rb)
+        {
+            rb = fault_read(fd, block, probe_transfer(pos, blocksize, probebytes), UINT_MAX, pos);
+            if (rb <= 0) { failed = 1; break; }
+        }
+
+        ts4 = timestamp();
+
+        close(fd);
+        unlink(filename);
+
+        if (failed) {
+            printf("Error probing block size %u KiB: %s\n", blocksize / 1024, strerror(errno));
             break;
-        case 'h':
-        default:
-            print_usage(argv);
         }
-    }
-
-    if ( gopt_file_limit != UINT_MAX ) fulfill = 0; //other way, after set number of big files, filling up big disk with small block could take ages, make too much stress and cause other problems
 
-    if (optind < argc)
-        print_usage(argv);
+        if ((ts2 - ts1) + (ts4 - ts3) == 0) continue;
+
+        /* combined rate: moving the probe data to and from the disk */
+        rate = 2.0 * probebytes / 1000.0 / 1000.0 / ((ts2 - ts1) + (ts4 - ts3));
 
-    //for formating position numbers
-    filenumbersize = strlen( formatNumbernospac ( (uint64_t) gopt_file_size * 1024 * 1024 , separated_number + 22) );
+        printf("Block %6u KiB:   write % 12.3f MB/s   read % 12.3f MB/s\n", blocksize / 1024,
+               ts2 - ts1 != 0 ? probebytes / 1000.0 / 1000.0 / (ts2 - ts1) : 0.0,
+               ts4 - ts3 != 0 ? probebytes / 1000.0 / 1000.0 / (ts4 - ts3) : 0.0);
+        fflush(stdout);
+
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_size = blocksize;
+        }
+    }
+
+    gopt_block_size = best_size;
+
+    consoleColor("cyan");
+    printf("Using block size %u KiB\n", gopt_block_size / 1024);
+    consoleColor("white");
 }
 
-/* unlink (delete) old random files */
-void unlink_randfiles(void)
+/* record block size for later verification runs */
+void blocksize_record_write(void)
 {
-    unsigned int filenum = 0;
-    char filename[32];
-
-    consoleColor("red");
+    FILE* f;
 
-    while (filenum < UINT_MAX)
-    {
-        char filename[32];
-        snprintf(filename, sizeof(filename), "random-%08u", filenum);
+    if (gopt_block_size == 1024 * 1024) {
+        unlink(BLOCKSIZE_RECORD);
+        return;
+    }
 
-        if (unlink(filename) != 0)
-            break;
+    f = fopen(BLOCKSIZE_RECORD, "w");
+    if (f == NULL) {
+        printf("Error writing %s: %s\n", BLOCKSIZE_RECORD, strerror(errno));
+        return;
+    }
+    fprintf(f, "%u\n", gopt_block_size / 1024);
+    fclose(f);
+}
 
-        if (filenum == 0)
-            printf("Removing old files .");
-        else
-            printf(".");
-        fflush(stdout);
+/* use recorded block size if none was given */
+void blocksize_record_read(void)
+{
+    FILE* f;
+    unsigned int kib;
 
-        ++filenum;
-    }
-
-    snprintf(filename, sizeof(filename), "random-%08u", filenum);
-    if (unlink(filename) == 0)
-            ++filenum;
+    if (gopt_block_size_set) return;
 
-    if (filenum > 0)
-        printf(" total: %u.\n", filenum);
-
+    f = fopen(BLOCKSIZE_RECORD, "r");
+    if (f == NULL) return;
+
+    if (fscanf(f, "%u", &kib) == 1 && kib > 0 && kib <= 1024 * 1024)
+    {
+        gopt_block_size = kib * 1024;
+        printf("Using recorded block size %u KiB\n", kib);
+    }
+    fclose(f);
+}
+
+/* a failed write other than a full disk is an error of the disk */
+static void write_error(const char* filename, unsigned int filenum, int err)
+{
+    ++errors_found;
+    mark_bad_file(filenum);
+    pthread_mutex_lock(&g_output_lock);
+    consoleColor("red");
+    printf("ERROR! %s write failed: %s\n", filename, strerror(err));
     consoleColor("white");
+    pthread_mutex_unlock(&g_output_lock);
+    gopt_unlink_after = 0;
+    if (gopt_stop_on_error) g_stop = 1;
 }
 
 /* fill disk */
@@ -355,6 +1764,10 @@ void fill_randfiles(void)
     char separated_number[50];
     char path[160];
 
+    item_type* block = arena_get(ARENA_WRITE, gopt_block_size);
+    size_t block2size = gopt_sector_size_in512 * 512;
+    item_type* block2 = arena_get(ARENA_SMALL, block2size);  // slow writing
+
     printf("Writing files random-XXXXXXXX with seed %u", g_seed);
 
     if (multicolor == 1 )
@@ -372,17 +1785,16 @@ void fill_randfiles(void)
 //    ORG WRITE
 //*****************************************************************
 
-    while (!done && filenum < gopt_file_limit)
+    while (!done && !g_stop && filenum < gopt_file_limit)
     {
         char filename[32];
         int fd;
         double wtotal;
         ssize_t  wb, wp;
         unsigned int i, blocknum;
-        double ts1, ts2;
-        uint64_t rnd;
-
-        item_type block[1024*1024 / sizeof(item_type)];
+        double ts1, ts2, tsb;
+        uint64_t rnd, unflushed = 0;
+        size_t blocksize;
 
         snprintf(filename, sizeof(filename), "random-%08u", filenum);
 
@@ -406,20 +1818,26 @@ void fill_randfiles(void)
         wtotal = 0;
         ts1 = timestamp();
 
-        for (blocknum = 0; blocknum < gopt_file_size; ++blocknum)
+        for (blocknum = 0; blocknum < file_block_count(); ++blocknum)
         {
-            for (i = 0; i < sizeof(block) / sizeof(item_type); ++i)
+            blocksize = file_block_size(blocknum);
+
+            for (i = 0; i < blocksize / sizeof(item_type); ++i)
                 block[i] = lcg_random(&rnd); /*8!!!!  bytes*/
 
             wp = 0;
+            tsb = timestamp();
 
-            while ( wp != (ssize_t)sizeof(block) && !done )
+            while ( wp != (ssize_t)blocksize && !done )
             {
-                wb = write(fd, (char*)block + wp, sizeof(block) - wp);
+                wb = io_write(fd, (char*)block + wp, blocksize - wp, filenum - 1, (uint64_t)wtotal + wp);
 
                 if (wb <= 0) {
-                    printf("STATUS writing next file %s: %s\n",
-                           filename, strerror(errno));
+                    if (wb < 0 && errno != ENOSPC)
+                        write_error(filename, filenum - 1, errno);
+                    else
+                        printf("STATUS writing next file %s: %s\n",
+                               filename, strerror(errno));
                     done = 1;
                     break;
                 }
@@ -428,20 +1846,34 @@ void fill_randfiles(void)
                 }
            }
 
+            if (wp == (ssize_t)blocksize) latency_add(&g_write_latency, timestamp() - tsb);
+
             wtotal += wp;
+            unflushed += wp;
 
-            if (done) {break;}
+            if (gopt_flush_every && unflushed >= (uint64_t)gopt_flush_every * 1024 * 1024) {
+                timed_flush(fd, filenum - 1, filename);
+                unflushed = 0;
+            }
+
+            if (done || g_stop) {break;}
         }
 
+        /* the trailing verifier must find the file on the disk */
+        if ((gopt_flush_file_end || gopt_flush_every || gopt_verify_lag) && unflushed)
+            timed_flush(fd, filenum - 1, filename);
+
         if (gopt_unlink_immediate) { /* do not close file handle! */
             filehandle_append(fd);
              }
         else { close(fd); }
 
         ts2 = timestamp();
+
+        pthread_mutex_lock(&g_output_lock);
         if ( wtotal == 0 )
         {
-            if ( multicolor == 1 ) printf("No space for new file ( 1 MiB block ).\n");
+            if ( multicolor == 1 ) printf("No space for new file ( %u KiB block ).\n", gopt_block_size / 1024);
             unlink(filename);
         }
         else
@@ -453,27 +1885,43 @@ void fill_randfiles(void)
         }
 
         fflush(stdout);
+        pthread_mutex_unlock(&g_output_lock);
 
         gbytewrite += wtotal;  gbytewriten = gbytewrite;
         gtimewrite += ts2-ts1; gtimewriten = gtimewrite;
+
+        if ( wtotal != 0 )
+        { /* hand the finished file to the trailing verifier */
+            pthread_mutex_lock(&g_progress_lock);
+            ++g_files_done;
+            pthread_cond_signal(&g_progress_cond);
+            pthread_mutex_unlock(&g_progress_lock);
+        }
     }
 
+    pthread_mutex_lock(&g_progress_lock);
+    g_fill_finished = 1;
+    pthread_cond_signal(&g_progress_cond);
+    pthread_mutex_unlock(&g_progress_lock);
+
     done = 0;
 
 //*****************************************************************
 //    NEW small WRITE
 //*****************************************************************
 
-    if ( fulfill == 1 )
+    if ( fulfill == 1 && !g_stop )
     {
+        pthread_mutex_lock(&g_output_lock);
         consoleColor("brightWhite");
         printf("Filling up disk with block = %s B", formatNumber (gopt_sector_size_in512* 512,separated_number + 20,7));
         if (multicolor == 1) printf(" (not included in total speed stats)");
         printf("\n");
         consoleColor("white");
+        pthread_mutex_unlock(&g_output_lock);
     }
 
-    while ( !done && fulfill == 1 )  // filling up
+    while ( !done && !g_stop && fulfill == 1 )  // filling up
     {
 
         char filename[32];
@@ -484,7 +1932,6 @@ void fill_randfiles(void)
         double ts1, ts2;
         uint64_t rnd;
 
-        item_type block2[ gopt_sector_size_in512 * 512 / sizeof(item_type)];  // slow writing
         /* cluster size
         16 KiB on USB 1 GB drive
         4 KiB on half of 256 GB drive partition
@@ -518,17 +1965,20 @@ void fill_randfiles(void)
 
         for (blocknum = 0; blocknum < 2048 + 2 ; ++blocknum)
         {
-            for (i = 0; i < sizeof(block2) / sizeof(item_type); ++i)
+            for (i = 0; i < block2size / sizeof(item_type); ++i)
                 block2[i] = lcg_random(&rnd); /*  8!!!!  bytes*/
 
             wp = 0;
 
-            while ( wp != (ssize_t)sizeof(block2) && !done )
+            while ( wp != (ssize_t)block2size && !done )
             {
-                wb = write(fd, (char*)block2 + wp, sizeof(block2) - wp);
+                wb = io_write(fd, (char*)block2 + wp, block2size - wp, filenum - 1, (uint64_t)wtotal + wp);
 
                 if (wb <= 0) {
-                    printf("STATUS writing next file %s: %s\n", filename, strerror(errno));
+                    if (wb < 0 && errno != ENOSPC)
+                        write_error(filename, filenum - 1, errno);
+                    else
+                        printf("STATUS writing next file %s: %s\n", filename, strerror(errno));
                     done = 1;
                     break;
                 }
@@ -547,84 +1997,468 @@ void fill_randfiles(void)
              }
         else { close(fd); }
 
-        ts2 = timestamp();
+        ts2 = timestamp();
+
+        pthread_mutex_lock(&g_output_lock);
+        if ( wtotal == 0 )
+        {
+            if ( multicolor == 1 ) printf("No space for new file ( %u B block ).\n",gopt_sector_size_in512 * 512 );
+            unlink(filename);
+        }
+        else
+        {
+            printf("Wrote   % 9.3f kB data to %s ", wtotal / 1000.0,filename);
+            if ( ts2-ts1 != 0 )  printf("with        % 12.3f MB/s\n"
+                                        , wtotal / 1000.0 / 1000.0 / (ts2-ts1) );
+            else                 printf("(measured time too short)\n");
+        }
+
+        fflush(stdout);
+        pthread_mutex_unlock(&g_output_lock);
+
+        gbytewrite += wtotal; gtimewrite += ts2-ts1;
+    } // end of small write
+
+    errno = 0;
+}
+
+/* forensic index: first word of every index step (a multiple of the -d
+ * sector size) of every file, sorted by the upper 32 bits, with the position
+ * as file * g_forensic_steps_per_file + step */
+#define FORENSIC_MAX_ENTRIES (1u << 25)     /* 256 MiB of index */
+
+struct forensic_entry
+{
+    uint32_t tag;
+    uint32_t location;
+};
+
+struct forensic_entry* g_forensic_index = NULL;
+size_t g_forensic_size = 0;
+unsigned int g_forensic_steps_per_file = 0;
+unsigned int g_forensic_step = 0;           /* index granularity in bytes */
+unsigned int g_forensic_files = 0;          /* files in the index */
+pthread_mutex_t g_forensic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bad block classes counted for the summary */
+enum { FORENSIC_BITFLIP, FORENSIC_ZERO, FORENSIC_ONES, FORENSIC_PATTERN,
+       FORENSIC_MISPLACED, FORENSIC_UNKNOWN, FORENSIC_CLASSES };
+
+unsigned int g_forensic_count[FORENSIC_CLASSES];
+
+static const char* forensic_class_name[FORENSIC_CLASSES] = {
+    "bit flips", "all zero", "all ones", "repeating pattern",
+    "misplaced data", "unknown data"
+};
+
+static int forensic_entry_cmp(const void* a, const void* b)
+{
+    const struct forensic_entry* ea = a;
+    const struct forensic_entry* eb = b;
+
+    if (ea->tag != eb->tag) return ea->tag < eb->tag ? -1 : 1;
+    return ea->location < eb->location ? -1 : (ea->location > eb->location);
+}
+
+/* generator state at byte offset of file filenum */
+static uint64_t forensic_offset_state(unsigned int filenum, uint64_t offset)
+{
+    struct lcg_jump jump = lcg_jump_ahead(offset / sizeof(item_type));
+
+    return jump.mul * (g_seed + filenum + 1) + jump.add;
+}
+
+/* build the index of all files, on the first bad block and again when more
+ * files were written since. Called with g_forensic_lock held */
+static void forensic_build_index(void)
+{
+    unsigned int* list;
+    unsigned int nfiles = 0, i, filenum, step;
+    uint64_t filebytes = (uint64_t)gopt_file_size * 1024 * 1024;
+    size_t pos = 0;
+    struct lcg_jump jump;
+    double ts1 = timestamp();
+
+    free(g_forensic_index);
+    g_forensic_index = NULL;
+    g_forensic_size = 0;
+
+    if (gopt_unlink_immediate)
+    {
+        list = NULL;
+        nfiles = g_filehandle_size;
+    }
+    else
+    {
+        unsigned int count = list_randfiles(&list);
+        for (i = 0; i < count; ++i)
+            if (list[i] + 1 > nfiles) nfiles = list[i] + 1;
+        free(list);
+    }
+
+    /* sector granularity finds single misdirected sectors, larger disks get a
+     * coarser index to stay within FORENSIC_MAX_ENTRIES */
+    g_forensic_step = gopt_sector_size_in512 * 512;
+    while ((uint64_t)nfiles * ((filebytes + g_forensic_step - 1) / g_forensic_step) > FORENSIC_MAX_ENTRIES
+           && g_forensic_step < filebytes)
+        g_forensic_step *= 2;
+
+    g_forensic_steps_per_file = (unsigned int)((filebytes + g_forensic_step - 1) / g_forensic_step);
+    jump = lcg_jump_ahead(g_forensic_step / sizeof(item_type));
+
+    if ((uint64_t)nfiles * g_forensic_steps_per_file > FORENSIC_MAX_ENTRIES)
+        nfiles = FORENSIC_MAX_ENTRIES / g_forensic_steps_per_file;
+
+    g_forensic_files = nfiles;
+    g_forensic_size = (size_t)nfiles * g_forensic_steps_per_file;
+    g_forensic_index = malloc(sizeof(struct forensic_entry) * (g_forensic_size + 1));
+    if (g_forensic_index == NULL) {
+        printf("Error allocating forensic index for %u files.\n", nfiles);
+        g_forensic_size = 0;
+        return;
+    }
+
+    for (filenum = 0; filenum < nfiles; ++filenum)
+    {
+        uint64_t state = g_seed + filenum + 1;
+
+        for (step = 0; step < g_forensic_steps_per_file; ++step)
+        {
+            uint64_t first = state;
+
+            g_forensic_index[pos].tag = (uint32_t)(lcg_random(&first) >> 32);
+            g_forensic_index[pos].location = (uint32_t)pos;
+            ++pos;
+
+            state = jump.mul * state + jump.add;
+        }
+    }
+
+    qsort(g_forensic_index, g_forensic_size, sizeof(struct forensic_entry), forensic_entry_cmp);
+
+    printf("Built forensic index of %u files at %u KiB granularity, %.3f MiB in %.3f s\n", nfiles,
+           g_forensic_step / 1024, g_forensic_size * sizeof(struct forensic_entry) / 1024.0 / 1024.0,
+           timestamp() - ts1);
+}
+
+/* find file and offset of the data starting with words[0] and words[1] in
+ * the index. Called with g_forensic_lock held */
+static int forensic_lookup(const item_type* words, size_t nwords,
+                           unsigned int* filenum, uint64_t* offset)
+{
+    size_t lo = 0, hi, pos;
+    uint32_t tag = (uint32_t)(words[0] >> 32);
+
+    /* lower bound of tag */
+    hi = g_forensic_size;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_forensic_index[mid].tag < tag) lo = mid + 1; else hi = mid;
+    }
+
+    for (pos = lo; pos < g_forensic_size && g_forensic_index[pos].tag == tag; ++pos)
+    {
+        unsigned int f = g_forensic_index[pos].location / g_forensic_steps_per_file;
+        uint64_t o = (uint64_t)(g_forensic_index[pos].location % g_forensic_steps_per_file) * g_forensic_step;
+        uint64_t state = forensic_offset_state(f, o);
+
+        /* tags collide, compare the full words */
+        if (lcg_random(&state) != words[0]) continue;
+        if (nwords > 1 && lcg_random(&state) != words[1]) continue;
+
+        *filenum = f;
+        *offset = o;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* find data of another place in the damaged words first to last of a block at
+ * blockpos of filenum: every sector of the damaged range is looked up, and
+ * found if its source offset is a multiple of the index granularity */
+static int forensic_find_source(unsigned int filenum, uint64_t blockpos,
+                                const item_type* block, size_t nwords, size_t first, size_t last,
+                                size_t* at, unsigned int* srcfile, uint64_t* srcoffset)
+{
+    size_t sector = gopt_sector_size_in512 * 512 / sizeof(item_type);
+    size_t p;
+    int found = 0;
+
+    pthread_mutex_lock(&g_forensic_lock);
+
+    /* the writer may have finished files since the index was built */
+    if (g_forensic_index == NULL || g_forensic_files < g_files_done)
+        forensic_build_index();
+
+    for (p = first - first % sector; p <= last && !found; p += sector)
+    {
+        if (!forensic_lookup(block + p, nwords - p, srcfile, srcoffset)) continue;
+
+        /* the data of this place itself, in an undamaged word */
+        if (*srcfile == filenum && *srcoffset == blockpos + p * sizeof(item_type)) continue;
+
+        *at = p;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&g_forensic_lock);
+
+    return found;
+}
+
+/* classify a bad block at byte offset blockpos of the file: state is the
+ * generator state at the block start */
+static void forensic_block(unsigned int filenum, unsigned int blocknum, uint64_t blockpos,
+                           const item_type* block, size_t nwords, uint64_t state)
+{
+    size_t i, badwords = 0, first = 0, last = 0, at = 0;
+    uint64_t flipped = 0, srcoffset = 0;
+    int zero = 1, ones = 1, pattern = 1, cls;
+    item_type patternword = 0;
+    unsigned int srcfile = 0;
+    char description[160];
+
+    for (i = 0; i < nwords; ++i)
+    {
+        item_type expected = lcg_random(&state);
+
+        if (block[i] == expected) continue;
+
+        /* patterns are checked in the damaged words only */
+        if (badwords == 0) { first = i; patternword = block[i]; }
+        last = i;
+        ++badwords;
+        flipped += __builtin_popcountll(block[i] ^ expected);
+
+        if (block[i] != 0) zero = 0;
+        if (block[i] != ~(item_type)0) ones = 0;
+        if (block[i] != patternword) pattern = 0;
+    }
+
+    if (badwords == 0) return;
+
+    if (zero) cls = FORENSIC_ZERO;
+    else if (ones) cls = FORENSIC_ONES;
+    else if (pattern && badwords > 1) cls = FORENSIC_PATTERN;
+    else if (flipped <= 2 * badwords) cls = FORENSIC_BITFLIP;
+    else if (forensic_find_source(filenum, blockpos, block, nwords, first, last,
+                                  &at, &srcfile, &srcoffset)) cls = FORENSIC_MISPLACED;
+    else cls = FORENSIC_UNKNOWN;
+
+    switch (cls) {
+        case FORENSIC_PATTERN:
+            snprintf(description, sizeof(description), "repeating pattern 0x%016" PRIx64, patternword);
+            break;
+        case FORENSIC_MISPLACED:
+            snprintf(description, sizeof(description),
+                     "data at offset %lu belongs to random-%08u offset %" PRIu64,
+                     (unsigned long)(at * sizeof(item_type)), srcfile, srcoffset);
+            break;
+        default:
+            snprintf(description, sizeof(description), "%s", forensic_class_name[cls]);
+    }
+
+    pthread_mutex_lock(&g_output_lock);
+    ++g_forensic_count[cls];
+    consoleColor("yellow");
+    printf("FORENSIC random-%08u block %u: %s, %lu of %lu words differ (offset %lu to %lu), %" PRIu64 " bits flipped\n",
+           filenum, blocknum, description, (unsigned long)badwords, (unsigned long)nwords,
+           (unsigned long)(first * sizeof(item_type)), (unsigned long)(last * sizeof(item_type)), flipped);
+    consoleColor("white");
+    pthread_mutex_unlock(&g_output_lock);
+}
+
+/* drop the index, the next bad block rebuilds it for the current seed */
+void forensic_reset(void)
+{
+    pthread_mutex_lock(&g_forensic_lock);
+    free(g_forensic_index);
+    g_forensic_index = NULL;
+    g_forensic_size = 0;
+    g_forensic_files = 0;
+    pthread_mutex_unlock(&g_forensic_lock);
+}
+
+/* print bad block classes found */
+void forensic_summary(void)
+{
+    int cls;
+
+    for (cls = 0; cls < FORENSIC_CLASSES; ++cls)
+    {
+        if (g_forensic_count[cls] == 0) continue;
+        printf("  %8u bad blocks with %s\n", g_forensic_count[cls], forensic_class_name[cls]);
+    }
+}
+
+/* read one file in gopt_block_size blocks and check random sequence, returns
+ * nonzero if the file is missing or ended before gopt_file_size MiB */
+static int read_randfile(unsigned int filenum, item_type* block)
+{
+    char filename[32];
+    int fd;
+    int done = 0;
+    double rtotal;
+    ssize_t rb;
+    unsigned int i, blocknum, blockerrors;
+    double ts1, ts2, tsb;
+    uint64_t rnd, blockrnd;
+
+    char separated_number[50];
+
+    snprintf(filename, sizeof(filename), "random-%08u", filenum);
+
+    /* reset random generator for each file */
+    rnd = g_seed + filenum + 1;
+
+    if (gopt_unlink_immediate)
+    {
+        fd = filehandle_get(filenum);
+        if (fd < 0) {
+            printf("Finished all opened file handles.\n");
+            return 1;
+        }
+
+        if (lseek(fd, 0, SEEK_SET) != 0) {
+            printf("Error seeking in next file %s: %s\n",
+                   filename, strerror(errno));
+            return 1;
+        }
+    }
+    else
+    {
+        fd = open(filename, O_RDONLY | O_BINARY);
+        if (fd < 0) {
+            printf("Error opening next file %s: %s\n",
+                   filename, strerror(errno));
+            return 1;
+        }
+    }
+
+    drop_cache(fd);
+
+    rtotal = 0;
+    ts1 = timestamp();
+
+    for (blocknum = 0; blocknum < file_block_count(); ++blocknum)
+    {
+        tsb = timestamp();
+        rb = read_block(fd, block, file_block_size(blocknum), filenum, (uint64_t)rtotal);
+        if (rb > 0) latency_add(&g_read_latency, timestamp() - tsb);
+
+        if (rb < 0) { /* unreadable data is an error, go on with the next file */
+            int err = errno;
+            ++errors_found;
+            mark_bad_file(filenum);
+            pthread_mutex_lock(&g_output_lock);
+            consoleColor("red");
+            printf("ERROR! %s BLOCK:%6u read failed: %s\n", filename, blocknum, strerror(err));
+            consoleColor("white");
+            pthread_mutex_unlock(&g_output_lock);
+            gopt_unlink_after = 0;
+            if (gopt_stop_on_error) { g_stop = 1; done = 1; }
+            break;
+        }
+
+        if (rb == 0) {
+            printf("STATUS reading file %s: %s\n",
+                   filename, strerror(errno));
+            done = 1;
+            break;
+        }
+
+        rtotal += rb;
+        blockrnd = rnd;
+        blockerrors = 0;
+
+        for (i = 0; i < rb  / sizeof(item_type); ++i)
+        {
+            if (block[i] != lcg_random(&rnd))
+            {
+                ++errors_found;
+                ++blockerrors;
+                mark_bad_file(filenum);
+                pthread_mutex_lock(&g_output_lock);
+                consoleColor("red");
+                printf("ERROR! %s Position: %s BLOCK:% 6lu OFFSET:% 7lu\n", filename
+                        , formatNumber ( (uint64_t) blocknum * gopt_block_size + (uint64_t) (i * sizeof(item_type)), separated_number + 20,filenumbersize+1)
+                       ,blocknum, (uint64_t) (i * sizeof(item_type)));
+
+                consoleColor("white");
+                pthread_mutex_unlock(&g_output_lock);
+                gopt_unlink_after = 0;
+                if (gopt_stop_on_error) { g_stop = 1; done = 1; }
+//                    break; //with this break 1. other errors in this block are not reported, and
+//                                             2. error is in every other block because lcg_random is not executed for every integer
+            }
+        }
+
+        if (blockerrors && gopt_forensic)
+            forensic_block(filenum, blocknum, (uint64_t)blocknum * gopt_block_size,
+                           block, rb / sizeof(item_type), blockrnd);
+
+        if (done || g_stop) {break;}
 
-        if ( wtotal == 0 )
-        {
-            if ( multicolor == 1 ) printf("No space for new file ( %u B block ).\n",gopt_sector_size_in512 * 512 );
-            unlink(filename);
-        }
-        else
-        {
-            printf("Wrote   % 9.3f kB data to %s ", wtotal / 1000.0,filename);
-            if ( ts2-ts1 != 0 )  printf("with        % 12.3f MB/s\n"
-                                        , wtotal / 1000.0 / 1000.0 / (ts2-ts1) );
-            else                 printf("(measured time too short)\n");
-        }
+    }
 
-        fflush(stdout);
+    if (!gopt_unlink_immediate) close(fd);
 
-        gbytewrite += wtotal; gtimewrite += ts2-ts1;
-    } // end of small write
-
-    errno = 0;
-}
-
-/* read files and check random sequence*/
-void read_randfiles(void)
-{
-    unsigned int filenum = 0;
-    int done = 0;
-    char path[160];
+    ts2 = timestamp();
 
-    printf("Verifying files random-XXXXXXXX with seed %u", g_seed);
+    pthread_mutex_lock(&g_output_lock);
+    printf("Read     %s MB data from %s",
+           formatNumber (rtotal / 1000.0 / 1000.0, separated_number + 20,8), filename);
+    if ( ts2-ts1 != 0 ) printf(" with      % 12.3f MB/s \n"
+                       ,(rtotal / 1000 / 1000 / (ts2-ts1)));
+    else // bad values for MB/s if very short time, divide by zero
+                        printf(" (measured time too short)\n");
 
-    if ( multicolor == 1 && gopt_readonly == 1 )
-    {
-        printf(" from directory\n");
-        getcwd(path, 160);
-        consoleColor("cyan");
-        printf("%s", path);
-        consoleColor("white");
-    }
+    fflush(stdout);
+    pthread_mutex_unlock(&g_output_lock);
 
-    printf("\n");
+    gbyteread += rtotal;
+    gtimeread += ts2-ts1;
 
-//*****************************************************************
-//    ORG READ
-//*****************************************************************
+    return done || g_stop;
+}
 
-    while (!done)
-    {
+/* read files written by the small filling up loop, starting at filenum */
+static void read_randfiles_small(unsigned int filenum)
+{
+    int done = 0;
+
+    while ( !done && !g_stop && gopt_file_limit == UINT_MAX && fulfill == 1  )
+    {  // testing "small" write
         char filename[32];
         int fd;
         double rtotal;
         ssize_t rb;
-        unsigned int i, blocknum;
+        unsigned int i, blocknum, blockerrors;
         double ts1, ts2;
-        uint64_t rnd;
+        uint64_t rnd, blockrnd;
 
         char separated_number[50];
 
-        item_type block[1024*1024 / sizeof(item_type)];
+        size_t blocksize = gopt_sector_size_in512 * 512;
+        item_type* block = arena_get(ARENA_SMALL, blocksize);
 
         snprintf(filename, sizeof(filename), "random-%08u", filenum);
-
-        /* reset random generator for each file */
-        rnd = g_seed + (++filenum);
 
         if (gopt_unlink_immediate)
         {
-            if (filenum >= g_filehandle_size) {
+            fd = filehandle_get(filenum);
+            if (fd < 0)
+            {
                 printf("Finished all opened file handles.\n");
                 break;
             }
 
-            fd = g_filehandle[filenum];
-
-            if (lseek(fd, 0, SEEK_SET) != 0) {
+            if (lseek(fd, 0, SEEK_SET) != 0)
+            {
                 printf("Error seeking in next file %s: %s\n",
-                       filename, strerror(errno));
+                        filename,strerror(errno));
                 break;
             }
         }
@@ -633,195 +2467,598 @@ void read_randfiles(void)
             fd = open(filename, O_RDONLY | O_BINARY);
             if (fd < 0) {
                 printf("Error opening next file %s: %s\n",
-                       filename, strerror(errno));
+                        filename,strerror(errno));
                 break;
             }
         }
 
+        /* reset random generator for each file */
+        rnd = g_seed + (++filenum);
+
+        drop_cache(fd);
+
         rtotal = 0;
         ts1 = timestamp();
 
-        for (blocknum = 0; blocknum < gopt_file_size; ++blocknum)
+        for (blocknum = 0; blocknum < 2048 + 2; ++blocknum)  // 2048 = 1024 * 1024 / 512 = max number (?) of 512 B sectors for 1 MiB block
         {
-            rb = read(fd, block, sizeof(block));
+            rb = read_block(fd, block, blocksize, filenum - 1, (uint64_t)rtotal);
+
+            if (rb < 0) {
+                int err = errno;
+                ++errors_found;
+                mark_bad_file(filenum - 1);
+                consoleColor("red");
+                printf("ERROR! %s BLOCK:%6u read failed: %s\n", filename, blocknum, strerror(err));
+                consoleColor("white");
+                gopt_unlink_after = 0;
+                if (gopt_stop_on_error) { g_stop = 1; done = 1; }
+                break;
+            }
 
-            if (rb <= 0) {
+            if (rb == 0) {
                 printf("STATUS reading file %s: %s\n",
-                       filename, strerror(errno));
-                done = 1;
+                        filename,strerror(errno));
+                done = 1;
                 break;
-            }
+                 }
+
+            blockrnd = rnd;
+            blockerrors = 0;
 
-            rtotal += rb;
-
             for (i = 0; i < rb  / sizeof(item_type); ++i)
             {
+
                 if (block[i] != lcg_random(&rnd))
                 {
                     ++errors_found;
+                    ++blockerrors;
+                    mark_bad_file(filenum - 1);
+
                     consoleColor("red");
+
                     printf("ERROR! %s Position: %s BLOCK:% 6lu OFFSET:% 7lu\n", filename
-                            , formatNumber ( (uint64_t) blocknum * 1024 * 1024+ (uint64_t) (i * sizeof(item_type)), separated_number + 20,filenumbersize+1)
-                           ,blocknum, (uint64_t) (i * sizeof(item_type)));
+                            , formatNumber ((uint64_t)blocknum * (uint64_t)gopt_sector_size_in512 * 512+ (uint64_t) (i * sizeof(item_type)), separated_number + 20,filenumbersize+1)
+                           ,blocknum,  (uint64_t) (i * sizeof(item_type)));
 
                     consoleColor("white");
                     gopt_unlink_after = 0;
-//                    break; //with this break 1. other errors in this block are not reported, and
-//                                             2. error is in every other block because lcg_random is not executed for every integer
+                    if (gopt_stop_on_error) { g_stop = 1; done = 1; }
+//                    break;
                 }
             }
 
-            if (done) {break;}
+            if (blockerrors && gopt_forensic)
+                forensic_block(filenum - 1, blocknum, (uint64_t)blocknum * blocksize,
+                               block, rb / sizeof(item_type), blockrnd);
 
-        }
+            rtotal += rb;
 
-        close(fd);
+            if (done) {break;}
+        }
+
+        if (!gopt_unlink_immediate) close(fd);
 
         ts2 = timestamp();
 
-        printf("Read     %s MB data from %s",
-               formatNumber (rtotal / 1000.0 / 1000.0, separated_number + 20,8), filename);
-        if ( ts2-ts1 != 0 ) printf(" with      % 12.3f MB/s \n"
-                           ,(rtotal / 1000 / 1000 / (ts2-ts1)));
-        else // bad values for MB/s if very short time, divide by zero
-                            printf(" (measured time too short)\n");
+        printf("Read    % 9.3f kB data from %s ",
+               (rtotal / 1000),               filename);
 
+        if ( ts2-ts1 != 0 ) printf("with      % 12.3f MB/s\n"
+                                   , rtotal / 1000 / 1000 / (ts2-ts1) );
+        else
+                            printf(" (measured time too short)\n");
+
         fflush(stdout);
 
-         gbyteread += rtotal;
-         gtimeread += ts2-ts1;
+        gbyteread += rtotal; gtimeread += ts2-ts1;
 
-    }
-
-    gbytereadn = gbyteread;gtimereadn = gtimeread;
-
-    done=0;
-
-//*****************************************************************
-//    NEW small READ
-//*****************************************************************
-
-        while ( !done && gopt_file_limit == UINT_MAX && fulfill == 1  )
-    {  // testing "small" write
-        char filename[32];
-        int fd;
-        double rtotal;
-        ssize_t rb;
-        unsigned int i, blocknum;
-        double ts1, ts2;
-        uint64_t rnd;
+    }
+}
 
-        char separated_number[50];
+/* read files and check random sequence*/
+void read_randfiles(void)
+{
+    unsigned int filenum = 0;
+    char path[160];
 
-        item_type block[ gopt_sector_size_in512 * 512 / sizeof(item_type)];
+    item_type* block = arena_get(ARENA_READ, gopt_block_size);
 
-        snprintf(filename, sizeof(filename), "random-%08u", filenum);
+    printf("Verifying files random-XXXXXXXX with seed %u", g_seed);
 
-        if (gopt_unlink_immediate)
-        {
-            if (filenum >= g_filehandle_size)
-            {
-                printf("Finished all opened file handles.\n");
-                break;
-            }
+    if ( multicolor == 1 && gopt_readonly == 1 )
+    {
+        printf(" from directory\n");
+        getcwd(path, 160);
+        consoleColor("cyan");
+        printf("%s", path);
+        consoleColor("white");
+    }
 
-            fd = g_filehandle[filenum];
+    printf("\n");
 
-            if (lseek(fd, 0, SEEK_SET) != 0)
-            {
-                printf("Error seeking in next file %s: %s\n",
-                        filename,strerror(errno));
-                break;
-            }
-        }
-        else
+    while (!read_randfile(filenum, block))
+        ++filenum;
+
+    gbytereadn = gbyteread;gtimereadn = gtimeread;
+
+    read_randfiles_small(filenum + 1);
+}
+
+/* trailing verifier: check file N while the writer is at N + gopt_verify_lag */
+static void* verifier_thread(void* arg)
+{
+    unsigned int filenum = 0;
+    int done = 0;
+    item_type* block = arena_get(ARENA_READ, gopt_block_size);
+
+    (void)arg;
+
+    while (!done && !g_stop)
+    {
+        pthread_mutex_lock(&g_progress_lock);
+        while (!g_fill_finished && g_files_done < filenum + gopt_verify_lag)
+            pthread_cond_wait(&g_progress_cond, &g_progress_lock);
+        done = (filenum >= g_files_done);
+        pthread_mutex_unlock(&g_progress_lock);
+
+        if (done) break;
+
+        done = read_randfile(filenum, block);
+        ++filenum;
+    }
+
+    return NULL;
+}
+
+/* start verifying behind the writer */
+void verify_while_writing_start(void)
+{
+    printf("Verifying files random-XXXXXXXX with seed %u while writing, %u file(s) behind\n",
+           g_seed, gopt_verify_lag);
+
+    if (pthread_create(&g_verifier, NULL, verifier_thread, NULL) != 0) {
+        printf("Error starting verifier thread, verifying after writing.\n");
+        gopt_verify_lag = 0;
+    }
+}
+
+/* wait for the trailing verifier and check the small filling up files */
+void verify_while_writing_finish(void)
+{
+    pthread_join(g_verifier, NULL);
+
+    gbytereadn = gbyteread; gtimereadn = gtimeread;
+
+    read_randfiles_small(g_files_done);
+}
+
+/* sysfs directory of the disk holding the current directory, returns 0 if
+ * there is none; dev gets "major:minor" of the file system device */
+int device_sysfs_path(char* path, size_t size, char* dev, size_t devsize)
+{
+#ifdef __linux__
+    struct stat st;
+    char link[PATH_MAX + 16], real[PATH_MAX];
+
+    if (stat(".", &st) != 0) return 0;
+
+    snprintf(dev, devsize, "%u:%u", major(st.st_dev), minor(st.st_dev));
+    snprintf(link, sizeof(link), "/sys/dev/block/%s", dev);
+
+    if (realpath(link, real) == NULL) return 0;
+
+    /* partitions are subdirectories of their disk */
+    snprintf(link, sizeof(link), "%s/partition", real);
+    if (access(link, F_OK) == 0) *strrchr(real, '/') = 0;
+
+    snprintf(path, size, "%s", real);
+    return 1;
+#else
+    (void)path; (void)size;
+    snprintf(dev, devsize, "-");
+    return 0;
+#endif
+}
+
+/* read first line of a small sysfs file without trailing white space */
+static int read_sysfs_line(const char* dir, const char* name, char* buf, size_t size)
+{
+    char path[PATH_MAX];
+    FILE* f;
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (f == NULL) return 0;
+
+    if (fgets(buf, size, f) == NULL) { fclose(f); return 0; }
+    fclose(f);
+
+    len = strlen(buf);
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == ' ')) buf[--len] = 0;
+
+    return len > 0;
+}
+
+/* identity of the device under test, without white space */
+void device_identity(char* id, size_t size)
+{
+    char model[128] = "", serial[128] = "", *c;
+
+#ifdef __linux__
+    char sysfs[PATH_MAX], dev[32];
+    struct statfs sfs;
+
+    if (device_sysfs_path(sysfs, sizeof(sysfs), dev, sizeof(dev)))
+    {
+        if (!read_sysfs_line(sysfs, "device/model", model, sizeof(model)))
+            snprintf(model, sizeof(model), "%s", strrchr(sysfs, '/') + 1);
+        if (!read_sysfs_line(sysfs, "device/serial", serial, sizeof(serial)) &&
+            !read_sysfs_line(sysfs, "serial", serial, sizeof(serial)))
+            read_sysfs_line(sysfs, "device/wwid", serial, sizeof(serial));
+    }
+    else snprintf(model, sizeof(model), "dev-%s", dev);
+
+    if (serial[0] == 0 && statfs(".", &sfs) == 0)
+        snprintf(serial, sizeof(serial), "fs%lx-%" PRIu64 "MB", (unsigned long)sfs.f_type,
+                 (uint64_t)sfs.f_blocks * sfs.f_bsize / 1000 / 1000);
+#elif defined(_WIN32)
+    DWORD volserial = 0;
+    char fsname[32] = "";
+
+    if (GetVolumeInformationA(NULL, NULL, 0, &volserial, NULL, NULL, fsname, sizeof(fsname)))
+    {
+        snprintf(model, sizeof(model), "%s", fsname);
+        snprintf(serial, sizeof(serial), "%08lX", (unsigned long)volserial);
+    }
+#endif
+
+    snprintf(id, size, "%s/%s", model[0] ? model : "unknown", serial[0] ? serial : "unknown");
+
+    for (c = id; *c; ++c)
+        if (*c == ' ' || *c == '\t' || *c == '=') *c = '_';
+}
+
+/* value of key in a history line, NULL if missing */
+static const char* history_value(const char* line, const char* key, char* buf, size_t size)
+{
+    size_t keylen = strlen(key);
+    const char* p = line;
+
+    while (p && *p)
+    {
+        if (strncmp(p, key, keylen) == 0 && p[keylen] == '=')
         {
-            fd = open(filename, O_RDONLY | O_BINARY);
-            if (fd < 0) {
-                printf("Error opening next file %s: %s\n",
-                        filename,strerror(errno));
-                break;
-            }
+            size_t len = strcspn(p + keylen + 1, "\t\n");
+            if (len >= size) len = size - 1;
+            memcpy(buf, p + keylen + 1, len);
+            buf[len] = 0;
+            return buf;
         }
+        p = strchr(p, '\t');
+        if (p) ++p;
+    }
 
-        /* reset random generator for each file */
-        rnd = g_seed + (++filenum);
+    return NULL;
+}
 
-        rtotal = 0;
-        ts1 = timestamp();
+/* options of this run that change the measured speeds, as history fields */
+static void history_config(char* buf, size_t size)
+{
+    snprintf(buf, size, "mode=%s\tfile_mib=%u\tblock_kib=%u\tfill=%u\tpasses=%u"
+             "\tverify_lag=%u\tflush_every=%u\tflush_file_end=%d",
+             gopt_readonly ? "verify" : "write", gopt_file_size, gopt_block_size / 1024,
+             fulfill, gopt_passes, gopt_verify_lag, gopt_flush_every, gopt_flush_file_end);
+}
 
-        for (blocknum = 0; blocknum < 2048 + 2; ++blocknum)  // 2048 = 1024 * 1024 / 512 = max number (?) of 512 B sectors for 1 MiB block
-        {
-            rb = read(fd, block, sizeof(block));
+/* nonzero if a history line has all fields of config with the same values */
+static int history_same_config(const char* line, const char* config)
+{
+    char key[32], buf[256];
+    const char* p = config;
+
+    while (*p)
+    {
+        size_t keylen = strcspn(p, "=");
+        size_t len = strcspn(p + keylen + 1, "\t");
+
+        if (keylen >= sizeof(key)) return 0;
+        memcpy(key, p, keylen);
+        key[keylen] = 0;
+
+        if (!history_value(line, key, buf, sizeof(buf)) || strlen(buf) != len ||
+            strncmp(buf, p + keylen + 1, len) != 0)
+            return 0;
+
+        p += keylen + 1 + len;
+        if (*p == '\t') ++p;
+    }
+
+    return 1;
+}
+
+/* one sided 95% quantile of Student's t distribution */
+static double t_quantile_95(unsigned int df)
+{
+    static const double table[] = {
+        6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+        1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725
+    };
+
+    if (df == 0) return 0;
+    if (df <= sizeof(table) / sizeof(table[0])) return table[df - 1];
+    if (df <= 30) return 1.697;
+    return 1.645;
+}
+
+/* compare one metric of this run against earlier runs of the same device and
+ * options, higher_is_better selects the direction of a regression */
+static void history_compare_metric(const char* name, const char* key, double current,
+                                   int higher_is_better, const char* id)
+{
+    FILE* f;
+    char line[2048], buf[256], config[256];
+    double sum = 0, sumsq = 0, mean, sd, t, limit;
+    unsigned int n = 0;
+
+    if (current == 0) return;
+
+    f = fopen(gopt_history, "r");
+    if (f == NULL) return;
+
+    history_config(config, sizeof(config));
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        double value;
+
+        if (!history_value(line, "device", buf, sizeof(buf)) || strcmp(buf, id) != 0) continue;
+        if (!history_same_config(line, config)) continue;
+        if (!history_value(line, key, buf, sizeof(buf))) continue;
+
+        value = atof(buf);
+        if (value == 0) continue;
+
+        sum += value;
+        sumsq += value * value;
+        ++n;
+    }
+
+    fclose(f);
+
+    if (n < 2) {
+        printf("  %-22s % 12.3f  baseline needs 2 earlier runs, has %u\n", name, current, n);
+        return;
+    }
+
+    mean = sum / n;
+    sd = sqrt(fmax(0, (sumsq - n * mean * mean) / (n - 1)));
+
+    /* prediction interval of a single new run */
+    limit = t_quantile_95(n - 1) * sd * sqrt(1.0 + 1.0 / n);
+    t = higher_is_better ? mean - current : current - mean;
+
+    if (t > limit && t > 0) consoleColor("red");
+    printf("  %-22s % 12.3f  baseline % 12.3f +- % 10.3f (%u runs) %+7.1f %%%s\n", name,
+           current, mean, sd, n, 100.0 * (current - mean) / mean,
+           (t > limit && t > 0) ? "  SIGNIFICANT REGRESSION" : "");
+    consoleColor("white");
+}
+
+/* compare this run against the history of the device under test */
+void history_compare(void)
+{
+    char id[320];
+
+    device_identity(id, sizeof(id));
+
+    printf("Comparing with history of %s in %s\n", id, gopt_history);
+
+    if (gopt_readonly == 0)
+        history_compare_metric("write MB/s", "write_mbs",
+                               gtimewriten != 0 ? gbytewriten / 1000 / 1000 / gtimewriten : 0, 1, id);
+    history_compare_metric("read MB/s", "read_mbs",
+                           gtimereadn != 0 ? gbytereadn / 1000 / 1000 / gtimereadn : 0, 1, id);
+    if (gopt_readonly == 0)
+        history_compare_metric("write p99 block ms", "write_p99_ms",
+                               latency_percentile(&g_write_latency, 0.99) * 1000, 0, id);
+    history_compare_metric("read p99 block ms", "read_p99_ms",
+                           latency_percentile(&g_read_latency, 0.99) * 1000, 0, id);
+    history_compare_metric("flush p99 ms", "flush_p99_ms",
+                           latency_percentile(&g_flush_latency, 0.99) * 1000, 0, id);
+}
+
+/* append key metrics of this run to the history file */
+void history_append(void)
+{
+    FILE* f;
+    char id[320], date[32], config[256];
+    time_t now = time(NULL);
+
+    f = fopen(gopt_history, "a");
+    if (f == NULL) {
+        printf("Error appending to history %s: %s\n", gopt_history, strerror(errno));
+        return;
+    }
+
+    device_identity(id, sizeof(id));
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    history_config(config, sizeof(config));
+
+    fprintf(f, "time=%s\tdevice=%s\tseed=%u\t%s", date, id, g_seed, config);
+
+    if (gopt_readonly == 0 && gtimewriten != 0)
+        fprintf(f, "\twrite_mb=%.3f\twrite_mbs=%.3f\twrite_p50_ms=%.3f\twrite_p99_ms=%.3f",
+                gbytewrite / 1000 / 1000, gbytewriten / 1000 / 1000 / gtimewriten,
+                latency_percentile(&g_write_latency, 0.5) * 1000,
+                latency_percentile(&g_write_latency, 0.99) * 1000);
+    if (gtimereadn != 0)
+        fprintf(f, "\tread_mb=%.3f\tread_mbs=%.3f\tread_p50_ms=%.3f\tread_p99_ms=%.3f",
+                gbyteread / 1000 / 1000, gbytereadn / 1000 / 1000 / gtimereadn,
+                latency_percentile(&g_read_latency, 0.5) * 1000,
+                latency_percentile(&g_read_latency, 0.99) * 1000);
+    if (g_flush_latency.total != 0)
+        fprintf(f, "\tflush_p50_ms=%.3f\tflush_p99_ms=%.3f",
+                latency_percentile(&g_flush_latency, 0.5) * 1000,
+                latency_percentile(&g_flush_latency, 0.99) * 1000);
+
+    fprintf(f, "\terrors=%u\n", errors_found);
+    fclose(f);
+}
+
+/* device statistics of the block device holding the current directory */
+struct device_sample
+{
+    int valid;
+    double time;
+    uint64_t reads, reads_merged, sectors_read, read_ms;
+    uint64_t writes, writes_merged, sectors_written, write_ms;
+    uint64_t io_ms, weighted_ms;
+};
+
+char g_device_name[64] = "";
+char g_device_stat[PATH_MAX + 32] = "";     /* sysfs stat file or volume path */
+
+/* find the device and print its queue settings */
+void device_stats_init(void)
+{
+#ifdef __linux__
+    char sysfs[PATH_MAX], dev[32], value[64];
+    static const char* queue[] = { "queue/scheduler", "queue/nr_requests",
+                                   "queue/rotational", "queue/max_sectors_kb" };
+    unsigned int i;
+
+    if (!device_sysfs_path(sysfs, sizeof(sysfs), dev, sizeof(dev)))
+    {
+        printf("Device statistics: no block device found for file system device %s\n", dev);
+        return;
+    }
+
+    snprintf(g_device_name, sizeof(g_device_name), "%s", strrchr(sysfs, '/') + 1);
+    snprintf(g_device_stat, sizeof(g_device_stat), "/sys/dev/block/%s/stat", dev);
+
+    printf("Device statistics of %s (%s)", g_device_name, dev);
+    for (i = 0; i < sizeof(queue) / sizeof(queue[0]); ++i)
+        if (read_sysfs_line(sysfs, queue[i], value, sizeof(value)))
+            printf(", %s %s", queue[i] + 6, value);
+    printf("\n");
+#elif defined(_WIN32)
+    char volume[MAX_PATH];
+    size_t len;
 
-            if (rb <= 0) {
-                printf("STATUS reading file %s: %s\n",
-                        filename,strerror(errno));
-                done = 1;
-                break;
-                 }
+    if (!GetVolumePathNameA(".", volume, sizeof(volume))) return;
 
-            for (i = 0; i < rb  / sizeof(item_type); ++i)
-            {
+    /* "C:\" -> "\\.\C:" */
+    len = strlen(volume);
+    if (len > 0 && volume[len-1] == '\\') volume[len-1] = 0;
+    snprintf(g_device_stat, sizeof(g_device_stat), "\\\\.\\%s", volume);
+    snprintf(g_device_name, sizeof(g_device_name), "%s", volume);
 
-                if (block[i] != lcg_random(&rnd))
-                {
-                    ++errors_found;
-
-                    consoleColor("red");
-
-                    printf("ERROR! %s Position: %s BLOCK:% 6lu OFFSET:% 7lu\n", filename
-                            , formatNumber ((uint64_t)blocknum * (uint64_t)gopt_sector_size_in512 * 512+ (uint64_t) (i * sizeof(item_type)), separated_number + 20,filenumbersize+1)
-                           ,blocknum,  (uint64_t) (i * sizeof(item_type)));
-
-                    consoleColor("white");
-                    gopt_unlink_after = 0;
-//                    break;
-                }
-            }
-
-            rtotal += rb;
+    printf("Device statistics of volume %s\n", g_device_name);
+#else
+    printf("Device statistics are not supported on this system.\n");
+#endif
+}
 
-        }
-
-        close(fd);
+/* take one sample, s->valid is 0 if the device could not be read */
+void device_sample(struct device_sample* s)
+{
+    memset(s, 0, sizeof(*s));
+    s->time = timestamp();
 
-        ts2 = timestamp();
-
-        printf("Read    % 9.3f kB data from %s ",
-               (rtotal / 1000),               filename);
-
-        if ( ts2-ts1 != 0 ) printf("with      % 12.3f MB/s\n"
-                                   , rtotal / 1000 / 1000 / (ts2-ts1) );
-        else
-                            printf(" (measured time too short)\n");
+    if (g_device_stat[0] == 0) return;
 
-        fflush(stdout);
-
-        gbyteread += rtotal; gtimeread += ts2-ts1;
+#ifdef __linux__
+    {
+        FILE* f = fopen(g_device_stat, "r");
+        if (f == NULL) return;
+
+        s->valid = fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+                             " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+                             " %*u %" SCNu64 " %" SCNu64,
+                          &s->reads, &s->reads_merged, &s->sectors_read, &s->read_ms,
+                          &s->writes, &s->writes_merged, &s->sectors_written, &s->write_ms,
+                          &s->io_ms, &s->weighted_ms) == 10;
+        fclose(f);
+    }
+#elif defined(_WIN32)
+    {
+        DISK_PERFORMANCE perf;
+        DWORD bytes;
+        HANDLE h = CreateFileA(g_device_stat, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+
+        if (h == INVALID_HANDLE_VALUE) return;
 
+        if (DeviceIoControl(h, IOCTL_DISK_PERFORMANCE, NULL, 0, &perf, sizeof(perf), &bytes, NULL))
+        {
+            /* times are in 100 ns, no merge counters on Windows */
+            s->reads = perf.ReadCount;
+            s->writes = perf.WriteCount;
+            s->sectors_read = perf.BytesRead.QuadPart / 512;
+            s->sectors_written = perf.BytesWritten.QuadPart / 512;
+            s->read_ms = perf.ReadTime.QuadPart / 10000;
+            s->write_ms = perf.WriteTime.QuadPart / 10000;
+            s->io_ms = (perf.QueryTime.QuadPart - perf.IdleTime.QuadPart) / 10000;
+            s->weighted_ms = s->read_ms + s->write_ms;
+            s->valid = 1;
+        }
+        CloseHandle(h);
     }
+#endif
 }
-
-//
-// MAIN
-//
 
-int main(int argc, char* argv[])
+/* print device side numbers of a phase next to the tool's own throughput */
+void device_report(const char* phase, const struct device_sample* a,
+                   const struct device_sample* b, double toolbytes)
+{
+    double elapsed = b->time - a->time;
+    double rbytes, wbytes, ios;
+
+    if (!a->valid || !b->valid || elapsed <= 0) return;
+
+    rbytes = (b->sectors_read - a->sectors_read) * 512.0;
+    wbytes = (b->sectors_written - a->sectors_written) * 512.0;
+    ios = (double)(b->reads - a->reads) + (double)(b->writes - a->writes);
+
+    consoleColor("cyan");
+    printf("Device %s during %s: tool % 10.3f MB/s, device write % 10.3f MB/s read % 10.3f MB/s\n",
+           g_device_name, phase, toolbytes / 1000 / 1000 / elapsed,
+           wbytes / 1000 / 1000 / elapsed, rbytes / 1000 / 1000 / elapsed);
+    printf("       queue depth % 6.2f, utilization % 5.1f %%, requests %.0f (avg % 8.1f KiB), merged %" PRIu64 " writes %" PRIu64 " reads\n",
+           (b->weighted_ms - a->weighted_ms) / 1000.0 / elapsed,
+           fmin(100.0, (b->io_ms - a->io_ms) / 10.0 / elapsed),
+           ios, ios != 0 ? (rbytes + wbytes) / 1024 / ios : 0.0,
+           b->writes_merged - a->writes_merged, b->reads_merged - a->reads_merged);
+    if (toolbytes > 0)
+        printf("       device transferred %.1f %% of the tool's bytes\n",
+               100.0 * (strcmp(phase, "reading") == 0 ? rbytes : wbytes) / toolbytes);
+    consoleColor("white");
+    fflush(stdout);
+}
+
+/* fill and verify once, or only verify with -v */
+void run_pass(void)
 {
-    double gts, gte; //global start and end
     time_t curtime;
     struct tm * curtimestruct;
     char separated_number[50];
-
-    parse_commandline(argc, argv);
-
-    gts = timestamp();
+    struct device_sample ds1, ds2;
+    double bytes;
+    unsigned int pass_errors = errors_found, trailing_errors = 0;
+    unsigned int pass_classes[FORENSIC_CLASSES], trailing_classes[FORENSIC_CLASSES];
+    int cls;
 
+    memcpy(pass_classes, g_forensic_count, sizeof(pass_classes));
+
     if (gopt_readonly == 0)
     {
         unlink_randfiles();
 
+        blocksize_record_write();
+
             if (multicolor == 1)
             {
                 consoleColor("green");
@@ -829,8 +3066,18 @@ int main(int argc, char* argv[])
                 consoleColor("white");
             };
 
+        if (gopt_verify_lag) verify_while_writing_start();
+
+        if (gopt_device_stats) device_sample(&ds1);
+        bytes = gbytewrite;
+
         fill_randfiles();
 
+        if (gopt_device_stats) {
+            device_sample(&ds2);
+            device_report("writing", &ds1, &ds2, gbytewrite - bytes);
+        }
+
         if (multicolor == 1)
         { //write stat
             consoleColor("yellow");
@@ -843,24 +3090,609 @@ int main(int argc, char* argv[])
             else                      printf(" (measured time too short)\n");
         };
 
+        flush_summary();
+
+        if (gopt_verify_lag) verify_while_writing_finish();
+
+        /* an index built while writing misses the later files */
+        if (gopt_verify_lag) forensic_reset();
+
+        /* the final pass reads the same blocks again, count them once */
+        trailing_errors = errors_found - pass_errors;
+        for (cls = 0; cls < FORENSIC_CLASSES; ++cls)
+            trailing_classes[cls] = g_forensic_count[cls] - pass_classes[cls];
     }
-    if (multicolor == 1)
+
+    if ( gopt_readonly == 1 || gopt_verify_lag == 0 || ( gopt_verify_final == 1 && !g_stop ) )
+    {
+        if (multicolor == 1)
+        {
+            consoleColor("green");
+            curtime = time(NULL); curtimestruct = localtime(&curtime);printf("START READING  %s", asctime(curtimestruct));
+            consoleColor("white");
+        }
+
+
+        if (gopt_device_stats) device_sample(&ds1);
+        bytes = gbyteread;
+
+        if (gopt_readonly == 0 && gopt_verify_lag)
+        {
+            errors_found = pass_errors;
+            memcpy(g_forensic_count, pass_classes, sizeof(pass_classes));
+        }
+
+        read_randfiles();
+
+        if (gopt_readonly == 0 && gopt_verify_lag)
+        {
+            printf("Errors found while writing: %u, in the final verification: %u\n",
+                   trailing_errors, errors_found - pass_errors);
+
+            if (trailing_errors > errors_found - pass_errors)
+            {
+                errors_found = pass_errors + trailing_errors;
+                for (cls = 0; cls < FORENSIC_CLASSES; ++cls)
+                    g_forensic_count[cls] = pass_classes[cls] + trailing_classes[cls];
+            }
+        }
+
+        if (gopt_device_stats) {
+            device_sample(&ds2);
+            device_report("reading", &ds1, &ds2, gbyteread - bytes);
+        }
+
+        if (multicolor == 1)
+        {
+            consoleColor("yellow");
+            curtime = time(NULL); curtimestruct = localtime(&curtime);printf("END   READING  %s", asctime(curtimestruct));
+            consoleColor("white");
+        }
+    }
+}
+
+/* burn-in: statistics of each pass */
+struct pass_stats
+{
+    unsigned int seed;
+    int verify_only;
+    double write_rate, read_rate;   /* MB/s without small filling data */
+    double write_p99, read_p99;     /* block latency in s */
+    unsigned int errors;
+    unsigned int new_bad_files;
+    unsigned int drift;             /* number of degradation flags */
+};
+
+/* relative change in percent, 0 if there is no baseline */
+static double drift_percent(double value, double base)
+{
+    if (base == 0) return 0;
+    return 100.0 * (value - base) / base;
+}
+
+/* print one pass and flag degradation against the first pass */
+static void burnin_pass_report(struct pass_stats* ps, const struct pass_stats* base,
+                               unsigned int pass)
+{
+    double d;
+
+    consoleColor("brightWhite");
+    printf("PASS %5u: seed %10u  write % 10.3f MB/s  read % 10.3f MB/s  p99 block % 8.3f / % 8.3f ms  errors %u\n",
+           pass + 1, ps->seed, ps->write_rate, ps->read_rate,
+           ps->write_p99 * 1000, ps->read_p99 * 1000, ps->errors);
+    consoleColor("red");
+
+    if (!ps->verify_only && base->write_rate != 0 &&
+        (d = drift_percent(ps->write_rate, base->write_rate)) < -gopt_drift) {
+        printf("            DRIFT write throughput %+.1f %% against pass %u\n", d, 1);
+        ++ps->drift;
+    }
+    if ((d = drift_percent(ps->read_rate, base->read_rate)) < -gopt_drift) {
+        printf("            DRIFT read throughput %+.1f %% against pass %u\n", d, 1);
+        ++ps->drift;
+    }
+    if (!ps->verify_only && base->write_p99 != 0 &&
+        (d = drift_percent(ps->write_p99, base->write_p99)) > gopt_drift) {
+        printf("            DRIFT write p99 block latency %+.1f %% against pass %u\n", d, 1);
+        ++ps->drift;
+    }
+    if ((d = drift_percent(ps->read_p99, base->read_p99)) > gopt_drift) {
+        printf("            DRIFT read p99 block latency %+.1f %% against pass %u\n", d, 1);
+        ++ps->drift;
+    }
+    if (ps->new_bad_files) {
+        printf("            DRIFT errors in %u file(s) without errors in earlier passes\n", ps->new_bad_files);
+        ++ps->drift;
+    }
+
+    consoleColor("white");
+    fflush(stdout);
+}
+
+/* repeat fill and verify for --passes or --duration, changing the seed */
+void burnin_run(void)
+{
+    unsigned int pass, i, base_seed = g_seed, errors_before;
+    int readonly = gopt_readonly;
+    double start = timestamp();
+    struct pass_stats* stats = NULL;
+    unsigned char* seen_bad = NULL;
+    unsigned int seen_size = 0, drift_total = 0;
+    double totalbytewrite = 0, totaltimewrite = 0, totalbyteread = 0, totaltimeread = 0;
+    double totalbytewriten = 0, totaltimewriten = 0, totalbytereadn = 0, totaltimereadn = 0;
+    double minread = 0, maxread = 0, minwrite = 0, maxwrite = 0;
+
+    for (pass = 0; !g_stop; ++pass)
     {
+        struct pass_stats* ps;
+
+        if (gopt_passes != 0 && pass >= gopt_passes) break;
+        if (gopt_duration != 0 && pass > 0 && timestamp() - start >= gopt_duration * 60.0) break;
+
+        stats = realloc(stats, sizeof(struct pass_stats) * (pass + 1));
+        ps = &stats[pass];
+        memset(ps, 0, sizeof(*ps));
+
+        /* new seed for each writing pass, stale data must not verify */
+        ps->verify_only = readonly || (pass > 0 && gopt_retention);
+        if (pass > 0 && !ps->verify_only)
+        {
+            g_seed = base_seed + pass * 0x9E3779B9u;
+
+            if (gopt_unlink_immediate)
+            {
+                for (i = 0; i < g_filehandle_size; ++i) close(g_filehandle[i]);
+                g_filehandle_size = 0;
+            }
+            forensic_reset();
+        }
+        ps->seed = g_seed;
+        gopt_readonly = ps->verify_only;
+
+        gbyteread = gtimeread = gbytewrite = gtimewrite = 0;
+        gbytereadn = gtimereadn = gbytewriten = gtimewriten = 0;
+        memset(&g_write_latency, 0, sizeof(g_write_latency));
+        memset(&g_read_latency, 0, sizeof(g_read_latency));
+        memset(&g_flush_latency, 0, sizeof(g_flush_latency));
+        g_flush_time = 0;
+        g_files_done = 0;
+        g_fill_finished = 0;
+        if (g_bad_files) memset(g_bad_files, 0, g_bad_files_size);
+        errors_before = errors_found;
+
         consoleColor("green");
-        curtime = time(NULL); curtimestruct = localtime(&curtime);printf("START READING  %s", asctime(curtimestruct));
+        printf("BURN-IN PASS %u%s\n", pass + 1, ps->verify_only ? " (verify only)" : "");
         consoleColor("white");
+
+        run_pass();
+
+        ps->write_rate = gtimewriten != 0 ? gbytewriten / 1000 / 1000 / gtimewriten : 0;
+        ps->read_rate = gtimereadn != 0 ? gbytereadn / 1000 / 1000 / gtimereadn : 0;
+        ps->write_p99 = latency_percentile(&g_write_latency, 0.99);
+        ps->read_p99 = latency_percentile(&g_read_latency, 0.99);
+        ps->errors = errors_found - errors_before;
+
+        /* error ranges not seen in earlier passes */
+        for (i = 0; i < g_bad_files_size; ++i)
+        {
+            if (!g_bad_files[i]) continue;
+            if (i >= seen_size || !seen_bad[i]) ++ps->new_bad_files;
+        }
+        if (seen_size < g_bad_files_size)
+        {
+            seen_bad = realloc(seen_bad, g_bad_files_size);
+            memset(seen_bad + seen_size, 0, g_bad_files_size - seen_size);
+            seen_size = g_bad_files_size;
+        }
+        for (i = 0; i < g_bad_files_size; ++i)
+            seen_bad[i] |= g_bad_files[i];
+        if (pass == 0) ps->new_bad_files = 0;
+
+        burnin_pass_report(ps, &stats[0], pass);
+        drift_total += ps->drift;
+
+        totalbytewrite += gbytewrite;   totaltimewrite += gtimewrite;
+        totalbyteread += gbyteread;     totaltimeread += gtimeread;
+        totalbytewriten += gbytewriten; totaltimewriten += gtimewriten;
+        totalbytereadn += gbytereadn;   totaltimereadn += gtimereadn;
+
+        if (!ps->verify_only && ps->write_rate != 0) {
+            if (minwrite == 0 || ps->write_rate < minwrite) minwrite = ps->write_rate;
+            if (ps->write_rate > maxwrite) maxwrite = ps->write_rate;
+        }
+        if (ps->read_rate != 0) {
+            if (minread == 0 || ps->read_rate < minread) minread = ps->read_rate;
+            if (ps->read_rate > maxread) maxread = ps->read_rate;
+        }
     }
 
+    gopt_readonly = readonly;
 
-    read_randfiles();
+    /* totals over all passes for the summary in main */
+    gbytewrite = totalbytewrite;   gtimewrite = totaltimewrite;
+    gbyteread = totalbyteread;     gtimeread = totaltimeread;
+    gbytewriten = totalbytewriten; gtimewriten = totaltimewriten;
+    gbytereadn = totalbytereadn;   gtimereadn = totaltimereadn;
 
-    if (multicolor == 1)
+    consoleColor("yellow");
+    printf("BURN-IN %u passes: write % 10.3f to % 10.3f MB/s, read % 10.3f to % 10.3f MB/s, %u drift flags\n",
+           pass, minwrite, maxwrite, minread, maxread, drift_total);
+    consoleColor("white");
+
+    free(seen_bad);
+    free(stats);
+}
+
+/* issue the I/Os of a trace again, with recorded timing or as fast as
+ * possible; written data is the random sequence of the trace's seed */
+void replay_run(const char* filename)
+{
+    FILE* f;
+    struct trace_header header;
+    struct trace_record* records = NULL;
+    size_t size = 0, limit = 0, i, maxsize = 0;
+    int* fds = NULL;
+    unsigned int nfds = 0, failed = 0, ops[4] = { 0 };
+    struct latency_hist recorded, replayed;
+    double bytes = 0, start, recorded_end = 0;
+    item_type* block;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Error opening trace %s: %s\n", filename, strerror(errno));
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record))
     {
-        consoleColor("yellow");
-        curtime = time(NULL); curtimestruct = localtime(&curtime);printf("END   READING  %s", asctime(curtimestruct));
+        printf("Error: %s is not a trace of this version.\n", filename);
+        fclose(f);
+        return;
+    }
+
+    while (1)
+    {
+        if (size >= limit)
+        {
+            limit *= 2;
+            if (limit < 1024) limit = 1024;
+            records = realloc(records, sizeof(struct trace_record) * limit);
+        }
+        if (fread(&records[size], sizeof(struct trace_record), 1, f) != 1) break;
+        if (records[size].size > maxsize) maxsize = records[size].size;
+        ++size;
+    }
+    fclose(f);
+
+    g_seed = header.seed;
+    arena_init(maxsize + sizeof(item_type), 4096);
+    block = arena_get(ARENA_WRITE, maxsize + sizeof(item_type));
+
+    memset(&recorded, 0, sizeof(recorded));
+    memset(&replayed, 0, sizeof(replayed));
+
+    printf("Replaying %lu I/Os from %s with seed %u%s\n", (unsigned long)size, filename,
+           g_seed, gopt_replay_timing ? " at recorded timing" : "");
+    fflush(stdout);
+
+    start = timestamp();
+
+    for (i = 0; i < size; ++i)
+    {
+        struct trace_record* r = &records[i];
+        int op = (int)(r->op_offset >> 56);
+        uint64_t offset = r->op_offset & 0x00FFFFFFFFFFFFFFLLU;
+        size_t count = r->result >= 0 ? (size_t)r->result : r->size;  /* as transferred */
+        ssize_t result = 0;
+        double ts;
+
+        if (gopt_replay_timing)
+        {
+            double wait = r->timestamp_us / 1e6 - (timestamp() - start);
+            if (wait > 0) sleep_ms((unsigned int)(wait * 1000));
+        }
+
+        if (r->filenum >= nfds)
+        {
+            unsigned int n = r->filenum + 128;
+            fds = realloc(fds, sizeof(int) * n);
+            while (nfds < n) fds[nfds++] = -1;
+        }
+
+        if (fds[r->filenum] < 0)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "random-%08u", r->filenum);
+            fds[r->filenum] = open(name, O_RDWR | O_CREAT | O_BINARY, 0600);
+            if (fds[r->filenum] < 0) {
+                printf("Error opening file %s: %s\n", name, strerror(errno));
+                ++failed;
+                continue;
+            }
+        }
+
+        if (op == TRACE_WRITE)
+        { /* random sequence of the file from the word containing offset */
+            struct lcg_jump jump = lcg_jump_ahead(offset / sizeof(item_type));
+            uint64_t rnd = jump.mul * (g_seed + r->filenum + 1) + jump.add;
+            size_t w;
+
+            for (w = 0; w < (count + offset % sizeof(item_type) + sizeof(item_type) - 1) / sizeof(item_type); ++w)
+                block[w] = lcg_random(&rnd);
+        }
+
+        ts = timestamp();
+
+        if (op == TRACE_FLUSH)
+            result = flush_file(fds[r->filenum]);
+        else if (lseek(fds[r->filenum], offset, SEEK_SET) != (off_t)offset)
+            result = -1;
+        else if (op == TRACE_WRITE)
+            result = write(fds[r->filenum], (char*)block + offset % sizeof(item_type), count);
+        else
+            result = read(fds[r->filenum], block, count);
+
+        ts = timestamp() - ts;
+
+        if (result < 0) ++failed;
+        else if (op != TRACE_FLUSH) bytes += result;
+
+        if (op >= 1 && op <= 3) ++ops[op];
+        latency_add(&recorded, r->latency_us / 1e6);
+        latency_add(&replayed, ts);
+        recorded_end = r->timestamp_us / 1e6 + r->latency_us / 1e6;
+    }
+
+    for (i = 0; i < nfds; ++i)
+        if (fds[i] >= 0) close(fds[i]);
+
+    start = timestamp() - start;
+
+    printf("Replayed %u reads, %u writes, %u flushes, %.3f MB in %.3f s (recorded %.3f s), %u failed\n",
+           ops[TRACE_READ], ops[TRACE_WRITE], ops[TRACE_FLUSH], bytes / 1000 / 1000,
+           start, recorded_end, failed);
+    printf("Latency recorded p50 % 9.3f  p99 % 9.3f  max % 9.3f ms\n",
+           latency_percentile(&recorded, 0.5) * 1000, latency_percentile(&recorded, 0.99) * 1000,
+           recorded.max * 1000);
+    printf("Latency replayed p50 % 9.3f  p99 % 9.3f  max % 9.3f ms\n",
+           latency_percentile(&replayed, 0.5) * 1000, latency_percentile(&replayed, 0.99) * 1000,
+           replayed.max * 1000);
+
+    free(fds);
+    free(records);
+}
+
+/* metadata stress: create, stat, verify and unlink many small files sharded
+ * over subdirectories meta-XXXX, with per operation latencies */
+enum { MD_CREATE, MD_STAT, MD_VERIFY, MD_UNLINK, MD_PHASES };
+
+static const char* md_phase_name[MD_PHASES] = { "create", "stat", "verify", "unlink" };
+
+struct md_worker
+{
+    pthread_t thread;
+    int started;                /* thread is running, else it ran inline */
+    unsigned int index;
+    int phase;
+    item_type* buffer;          /* two md_size buffers: data and read back */
+    struct latency_hist latency;
+    unsigned int failed, errors;
+};
+
+/* create a directory */
+static int make_dir(const char* path)
+{
+#ifdef _WIN32
+    return mkdir(path);
+#else
+    return mkdir(path, 0700);
+#endif
+}
+
+static void md_filename(char* buf, size_t size, unsigned int filenum)
+{
+    snprintf(buf, size, "meta-%04u/m-%08u", filenum % gopt_md_shards, filenum);
+}
+
+/* fill buf with the content of metadata file filenum */
+static void md_content(item_type* buf, unsigned int filenum)
+{
+    uint64_t rnd = g_seed + filenum + 1;
+    size_t i;
+
+    for (i = 0; i < (gopt_md_size + sizeof(item_type) - 1) / sizeof(item_type); ++i)
+        buf[i] = lcg_random(&rnd);
+}
+
+static void* md_thread(void* arg)
+{
+    struct md_worker* w = arg;
+    item_type* data = w->buffer;
+    item_type* back = w->buffer + (gopt_md_size + sizeof(item_type) - 1) / sizeof(item_type);
+    unsigned int filenum;
+
+    for (filenum = w->index; filenum < gopt_md_files; filenum += gopt_md_threads)
+    {
+        char filename[48];
+        struct stat st;
+        double ts;
+        int fd, ok = 1;
+
+        md_filename(filename, sizeof(filename), filenum);
+
+        if (w->phase == MD_CREATE || w->phase == MD_VERIFY)
+            md_content(data, filenum);
+
+        ts = timestamp();
+
+        switch (w->phase) {
+            case MD_CREATE:
+                fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+                if (fd < 0) { ok = 0; break; }
+                if (write_block(fd, data, gopt_md_size, filenum, 0) != (ssize_t)gopt_md_size) ok = 0;
+                if (close(fd) != 0) ok = 0;
+                break;
+            case MD_STAT:
+                ok = stat(filename, &st) == 0 && st.st_size == (off_t)gopt_md_size;
+                break;
+            case MD_VERIFY:
+                fd = open(filename, O_RDONLY | O_BINARY);
+                if (fd < 0) { ok = 0; break; }
+                if (read_block(fd, back, gopt_md_size, filenum, 0) != (ssize_t)gopt_md_size) ok = 0;
+                close(fd);
+                if (ok && memcmp(data, back, gopt_md_size) != 0) ++w->errors;
+                break;
+            case MD_UNLINK:
+                ok = unlink(filename) == 0;
+                break;
+        }
+
+        latency_add(&w->latency, timestamp() - ts);
+        if (!ok) ++w->failed;
+    }
+
+    return NULL;
+}
+
+/* run the metadata stress phases with gopt_md_threads threads */
+void metadata_run(void)
+{
+    struct md_worker* workers = calloc(gopt_md_threads, sizeof(struct md_worker));
+    size_t stride = 2 * ((gopt_md_size + 4095) & ~(size_t)4095);
+    unsigned int t, shard, errors = 0;
+    int phase;
+    char dirname[32];
+
+    arena_init(stride * gopt_md_threads, 4096);
+
+    printf("Metadata test: %u files of %u B in %u directories meta-XXXX with %u thread(s), seed %u\n",
+           gopt_md_files, gopt_md_size, gopt_md_shards, gopt_md_threads, g_seed);
+
+    for (shard = 0; shard < gopt_md_shards; ++shard)
+    {
+        snprintf(dirname, sizeof(dirname), "meta-%04u", shard);
+        if (make_dir(dirname) != 0 && errno != EEXIST)
+            printf("Error creating directory %s: %s\n", dirname, strerror(errno));
+    }
+
+    for (phase = 0; phase < MD_PHASES; ++phase)
+    {
+        struct latency_hist total;
+        unsigned int failed = 0, b;
+        double ts = timestamp();
+
+        memset(&total, 0, sizeof(total));
+
+        for (t = 0; t < gopt_md_threads; ++t)
+        {
+            memset(&workers[t].latency, 0, sizeof(workers[t].latency));
+            workers[t].index = t;
+            workers[t].phase = phase;
+            workers[t].buffer = (item_type*)((char*)arena_get(ARENA_WRITE, stride * gopt_md_threads) + t * stride);
+            workers[t].failed = 0;
+            workers[t].started = pthread_create(&workers[t].thread, NULL, md_thread, &workers[t]) == 0;
+            if (!workers[t].started)
+                md_thread(&workers[t]);
+        }
+
+        for (t = 0; t < gopt_md_threads; ++t)
+            if (workers[t].started) pthread_join(workers[t].thread, NULL);
+
+        ts = timestamp() - ts;
+
+        for (t = 0; t < gopt_md_threads; ++t)
+        {
+            for (b = 0; b < LATENCY_BUCKETS; ++b)
+                total.count[b] += workers[t].latency.count[b];
+            total.total += workers[t].latency.total;
+            if (workers[t].latency.max > total.max) total.max = workers[t].latency.max;
+            failed += workers[t].failed;
+        }
+
+        printf("%-7s % 12.0f ops/s   p50 % 9.3f  p99 % 9.3f  max % 9.3f ms",
+               md_phase_name[phase], ts != 0 ? gopt_md_files / ts : 0.0,
+               latency_percentile(&total, 0.5) * 1000, latency_percentile(&total, 0.99) * 1000,
+               total.max * 1000);
+        if (failed) printf("   %u failed", failed);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    for (shard = 0; shard < gopt_md_shards; ++shard)
+    {
+        snprintf(dirname, sizeof(dirname), "meta-%04u", shard);
+        rmdir(dirname);
+    }
+
+    for (t = 0; t < gopt_md_threads; ++t)
+        errors += workers[t].errors;
+
+    if (errors) {
+        errors_found += errors;
+        gopt_unlink_after = 0;
+    }
+
+    free(workers);
+}
+
+//
+// MAIN
+//
+
+int main(int argc, char* argv[])
+{
+    double gts, gte; //global start and end
+    char separated_number[50];
+
+    parse_commandline(argc, argv);
+
+    if (gopt_replay)
+    {
+        replay_run(gopt_replay);
+        consoleColor("white");
+        return 0;
+    }
+
+    if (gopt_md_files)
+    {
+        metadata_run();
+        fault_summary();
+        if (errors_found != 0) {
+            consoleColor("red");
+            printf(" %u ERRORS found!!!!\n", errors_found);
+        }
+        else {
+            consoleColor("green");
+            printf("NO errors found.\n");
+        }
         consoleColor("white");
+        return 0;
     }
 
+    gts = timestamp();
+
+    if (gopt_trace) trace_start(gopt_trace);
+    if (gopt_device_stats) device_stats_init();
+
+    if (gopt_readonly == 1) blocksize_record_read();
+
+    /* a recorded block size read with auto may be larger than the probe */
+    arena_init(gopt_block_size_tune && gopt_block_size < 16 * 1024 * 1024 ? 16 * 1024 * 1024 : gopt_block_size,
+               gopt_sector_size_in512 * 512);
+
+    /* tune once, all burn-in passes use the same block size */
+    if (gopt_block_size_tune && gopt_readonly == 0)
+    {
+        unlink_randfiles();
+        tune_block_size();
+    }
+
+    if (gopt_passes != 1 || gopt_duration != 0)
+        burnin_run();
+    else
+        run_pass();
+
     if ( gopt_readonly == 1 && gopt_unlink_after )
             unlink_randfiles();
 
@@ -901,10 +3733,20 @@ int main(int argc, char* argv[])
     };
 
 
+    fault_summary();
+    trace_finish();
+
+    if (gopt_history)
+    {
+        if (gopt_compare) history_compare();
+        history_append();
+    }
+
     if (errors_found != 0)
     {
         consoleColor("red");
         printf(" %u ERRORS found!!!!\n", errors_found);
+        if (gopt_forensic) forensic_summary();
     }
     else
     {
@@ -914,7 +3756,7 @@ int main(int argc, char* argv[])
     }
 
 
-    if ( ( fulfill == 1 || g_seed != 1434038592 || gopt_file_size != 1024 ) && gopt_readonly == 0 && gopt_unlink_immediate == 0 && gbytewrite >0 )
+    if ( ( fulfill == 1 || g_seed != 1434038592 || gopt_file_size != 1024 || gopt_block_size != 1024 * 1024 ) && gopt_readonly == 0 && gopt_unlink_immediate == 0 && gbytewrite >0 )
     { // test tip
         consoleColor("cyan");
         printf("Use this parameters to test created files later: \n -v ");
@@ -926,6 +3768,8 @@ int main(int argc, char* argv[])
         else
         if ( fulfill == 1 ) printf(" -z");
 
+        if ( gopt_block_size != 1024 * 1024 ) printf(" --block-size %u", gopt_block_size / 1024);
+
         printf("\n");
 
     }
@@ -0,0 +1,143 @@
+#!/bin/sh
+# Error path tests for disk-filltest: build the tool, drive it with --fault on
+# a small temporary directory (tmpfs when available) and check the output and
+# the time of each case.
+#
+# usage: tests/run-faults.sh [time limit per case in seconds, default 60]
+# CC and CFLAGS select the compiler, TMPDIR the place of the test directory.
+
+set -u
+
+LIMIT=${1:-60}
+SRC=$(cd "$(dirname "$0")/.." && pwd)/disk-filltest.c
+
+if [ -d /dev/shm ] && [ -w /dev/shm ]; then BASE=${TMPDIR:-/dev/shm}; else BASE=${TMPDIR:-/tmp}; fi
+WORK=$(mktemp -d "$BASE/dft-faults.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+if ! ${CC:-cc} ${CFLAGS:--O2} -pthread -o "$WORK/disk-filltest" "$SRC" -lm 2> "$WORK/build.log"; then
+    cat "$WORK/build.log"
+    exit 1
+fi
+mkdir "$WORK/data"
+
+FAILED=0
+
+now() { date +%s.%N; }
+
+fail() {
+    echo "FAIL $NAME: $1"
+    sed 's/^/    /' "$WORK/out"
+    FAILED=$((FAILED + 1))
+}
+
+# run <name> <options...>: run the tool in an empty data directory, or on the
+# files of the previous run with KEEP=1
+KEEP=
+run() {
+    NAME=$1; shift
+    [ -n "$KEEP" ] || rm -f "$WORK"/data/random-* "$WORK"/data/disk-filltest.*
+    START=$(now)
+    (cd "$WORK/data" && "$WORK/disk-filltest" "$@") > "$WORK/out" 2>&1
+    STATUS=$?
+    ELAPSED=$(awk -v s="$START" -v e="$(now)" 'BEGIN { printf "%.3f", e - s }')
+    printf "%-8s %8s s\n" "$NAME" "$ELAPSED"
+    [ $STATUS -eq 0 ] || fail "exit status $STATUS"
+    awk -v t="$ELAPSED" -v l="$LIMIT" 'BEGIN { exit !(t > l) }' && fail "slower than $LIMIT s"
+}
+
+# expect <pattern>: output must contain the extended regular expression
+expect() {
+    grep -Eq "$1" "$WORK/out" || fail "missing \"$1\""
+}
+
+# count <fault>: number of injected faults of that kind in the summary
+count() {
+    sed -n "s/^Injected faults:.* \([0-9]*\) $1.*/\1/p" "$WORK/out"
+}
+
+# short transfers must be completed by the write and read loops
+run short -f 3 -S 8 --fault short=0.3,seed=7
+expect "NO errors found"
+[ "$(count 'short transfers')" -gt 0 ] || fail "no short transfers injected"
+
+# large writes fail in the 4th file, then the -z tail fill with small blocks
+# writes one full and one partial tail file until the disk is full
+run enospc -z -S 8 --fault enospc=40000000@30000000
+expect "STATUS writing next file random-00000003: No space left on device"
+expect "Read +4 MB data from random-00000003"
+expect "Wrote +8396.800 kB data to random-00000004"
+expect "Read +8396.800 kB data from random-00000004"
+expect "STATUS writing next file random-00000005: No space left on device"
+expect "Read +1603.200 kB data from random-00000005"
+expect "NO errors found"
+[ "$(count ENOSPC)" -gt 0 ] || fail "no ENOSPC injected"
+
+# a failed write is an error and ends the filling
+run weio -f 4 -S 8 --fault weio=2@1048576
+expect "ERROR! random-00000002 write failed: Input/output error"
+expect "Read +1 MB data from random-00000002"
+expect " 1 ERRORS found"
+
+# an unreadable block is an error, the following files are still verified
+run eio -f 4 -S 8 --fault eio=1@4096
+expect "ERROR! random-00000001 BLOCK: +0 read failed: Input/output error"
+expect "Read +8 MB data from random-00000003"
+expect " 1 ERRORS found"
+
+# a flipped bit is found in the word holding byte 123 and classified
+run flip -f 4 -S 8 --forensic --fault flip=2@123
+expect "ERROR! random-00000002 Position: +120 "
+expect " 1 ERRORS found"
+expect "1 bad blocks with bit flips"
+
+# a sector of another file written to the wrong place is found
+run write -f 8 -S 8 --block-size 64
+dd if="$WORK/data/random-00000001" of="$WORK/data/random-00000006" bs=4096 skip=2 seek=17 \
+   count=1 conv=notrunc 2> /dev/null
+KEEP=1
+run sector -v -S 8 --block-size 64 --forensic
+KEEP=
+expect "FORENSIC random-00000006 block 1: data at offset 4096 belongs to random-00000001 offset 8192"
+expect "1 bad blocks with misplaced data"
+
+# the final verification finds the same bad block again, it counts once
+run final -f 4 -S 8 --verify-lag 1 --verify-final --forensic --fault flip=2@123
+expect "Errors found while writing: 1, in the final verification: 1"
+expect " 1 ERRORS found"
+expect " 1 bad blocks with bit flips"
+
+# latency spikes: the run takes at least the injected delays
+run delay -f 2 -S 8 --block-size 512 --fault delay=20@0.5,seed=3
+expect "NO errors found"
+DELAYS=$(count delays)
+[ "${DELAYS:-0}" -gt 0 ] || fail "no delays injected"
+awk -v t="$ELAPSED" -v n="${DELAYS:-0}" 'BEGIN { exit !(t < n * 0.020) }' &&
+    fail "$ELAPSED s for $DELAYS delays of 20 ms"
+
+# the block size probe and the metadata files also see short transfers
+run tune -f 1 -S 4 --block-size auto --tune-size 8 --fault short=0.3,seed=11
+expect "Using block size [0-9]+ KiB"
+grep -q "Error probing" "$WORK/out" && fail "probe failed"
+expect "NO errors found"
+
+run meta --metadata 300 --md-size 10000 --fault short=0.5,seed=5
+grep -q "failed" "$WORK/out" && fail "metadata operations failed"
+expect "NO errors found"
+[ "$(count 'short transfers')" -gt 0 ] || fail "no short transfers injected"
+
+# a recorded block size above the 16 MiB probe buffer with --block-size auto
+run record -f 1 -S 64 --block-size 32768
+KEEP=1
+run recorded -v -S 64 --block-size auto
+KEEP=
+expect "Using recorded block size 32768 KiB"
+expect "Read +67 MB data from random-00000000"
+grep -q "STATUS reading" "$WORK/out" && fail "block did not fit the buffer"
+
+if [ $FAILED -ne 0 ]; then
+    echo "$FAILED failure(s)"
+    exit 1
+fi
+
+echo "All fault tests passed."